@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "dataset_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int dataset_tile_valid(int tile)
+{
+    return tile >= DATASET_MIN_TILE && tile <= DATASET_MAX_TILE && (tile & (tile - 1)) == 0;
+}
+
+int dataset_padd(int n, int align)
+{
+    return (n + align - 1) / align * align;
+}
+
+void dataset_cache_path(char *cache_path, size_t size, const char *raw_path)
+{
+    size_t len = strlen(raw_path);
+    if (len >= 4 && strcmp(raw_path + len - 4, ".bin") == 0) len -= 4;
+    snprintf(cache_path, size, "%.*s.cache", (int)len, raw_path);
+}
+
+static void set_geometry(dataset_cache_t *cache, int num_images, int tile)
+{
+    cache->num_images = num_images;
+    cache->tile = tile;
+    cache->image_size = 3 * tile * tile;
+    cache->padd_rows = dataset_padd(num_images, DATASET_PADD_ROWS_ALIGN);
+    cache->padd_cols = dataset_padd(num_images, DATASET_PADD_COLS_ALIGN);
+}
+
+static int map_cache(dataset_cache_t *cache, const char *path, int tile)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(dataset_cache_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const dataset_cache_header_t *header = (const dataset_cache_header_t*)map;
+    int valid = memcmp(header->magic, DATASET_CACHE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == DATASET_CACHE_VERSION
+        && header->num_images > 0
+        && header->image_size == 3 * tile * tile
+        && header->padd_rows == dataset_padd(header->num_images, DATASET_PADD_ROWS_ALIGN)
+        && header->padd_cols == dataset_padd(header->num_images, DATASET_PADD_COLS_ALIGN);
+    for (int i = 0; valid && i < DC_NUM_SECTIONS; ++i) {
+        if (header->offset[i] + header->size[i] > (long long)st.st_size) valid = 0;
+    }
+    if (!valid) {
+        printf("%s is not a valid dataset cache (version %d, %d x %d tiles expected)\n", path, DATASET_CACHE_VERSION, tile, tile);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    set_geometry(cache, header->num_images, tile);
+    const char *base = (const char*)map;
+    cache->dataset = (const unsigned char*)(base + header->offset[DC_DATASET]);
+    cache->dataset_t = (const unsigned char*)(base + header->offset[DC_DATASET_T]);
+    cache->norm = (const int*)(base + header->offset[DC_NORM]);
+    cache->pyr_l0 = (const int*)(base + header->offset[DC_PYR_L0]);
+    cache->pyr_l1 = (const unsigned short*)(base + header->offset[DC_PYR_L1]);
+    cache->pyr_l2 = (const unsigned short*)(base + header->offset[DC_PYR_L2]);
+    cache->map = map;
+    cache->map_size = st.st_size;
+    return 0;
+}
+
+static int read_raw(dataset_cache_t *cache, const char *path, int tile)
+{
+    FILE *fin = fopen(path, "rb");
+    if (!fin) return -1;
+
+    fseek(fin, 0, SEEK_END);
+    long length = ftell(fin);
+    rewind(fin);
+    const long image_size = 3 * tile * tile;
+    if (length <= 0 || length % image_size != 0) {
+        printf("%s is not a whole number of %d x %d images\n", path, tile, tile);
+        fclose(fin);
+        return -1;
+    }
+    set_geometry(cache, (int)(length / image_size), tile);
+
+    size_t size = (size_t)cache->num_images * cache->image_size;
+    size_t padd_size = (size_t)cache->padd_rows * cache->image_size;
+    unsigned char *buf = (unsigned char*)malloc(padd_size);
+    size_t n = fread(buf, 1, size, fin);
+    fclose(fin);
+    if (n != size) {
+        free(buf);
+        return -1;
+    }
+    memset(buf + size, 0, padd_size - size);
+
+    cache->dataset = buf;
+    cache->buf = buf;
+    return 0;
+}
+
+int dataset_cache_open(dataset_cache_t *cache, const char *cache_path, const char *raw_path, int tile)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (!dataset_tile_valid(tile)) {
+        printf("tile size %d is not a power of two in [%d, %d]\n", tile, DATASET_MIN_TILE, DATASET_MAX_TILE);
+        return -1;
+    }
+    if (cache_path && map_cache(cache, cache_path, tile) == 0) return 0;
+    return read_raw(cache, raw_path, tile);
+}
+
+void dataset_cache_close(dataset_cache_t *cache)
+{
+    if (cache->map) munmap(cache->map, cache->map_size);
+    free(cache->buf);
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * tile library of num_images images of 3 x tile x tile pixels, [n][c][h][w]
+ * (cifar-10 is 60000 images of 32 x 32), optionally backed by a preprocessed
+ * cache file (written once by trunk/mc17_prj/make_cache) that is mmap'ed
+ * read-only, so concurrent processes on a node share its pages
+ *
+ * without a cache file the raw dataset is read into a padded buffer and
+ * the optional sections below are NULL; callers compute them as before
+ */
+#define DATASET_DEFAULT_PATH "data/cifar-10.bin"
+#define DATASET_DEFAULT_TILE 32
+#define DATASET_MIN_TILE 8  // image size stays a multiple of the 64-wide gemm tiles
+#define DATASET_MAX_TILE 64 // pyramid block sums stay within unsigned short
+#define DATASET_PADD_ROWS_ALIGN 512 // rows of dataset
+#define DATASET_PADD_COLS_ALIGN 64  // columns of dataset_t
+
+#define DATASET_CACHE_MAGIC "MC17DSC"
+#define DATASET_CACHE_VERSION 1
+
+enum {
+    DC_DATASET,   // uchar [PADD_ROWS][IMAGE_SIZE], padded rows are zero
+    DC_DATASET_T, // uchar [IMAGE_SIZE][PADD_COLS], padded columns are zero
+    DC_NORM,      // int [PADD_ROWS], squared L2 norm of each row
+    DC_PYR_L0,    // int [NUM_IMAGES][3], see trunk/mc17_prj/pyramid.h
+    DC_PYR_L1,    // ushort [NUM_IMAGES][3][4][4]
+    DC_PYR_L2,    // ushort [NUM_IMAGES][3][8][8]
+    DC_NUM_SECTIONS
+};
+
+typedef struct {
+    char magic[8];
+    int version;
+    int num_images, image_size, padd_rows, padd_cols;
+    int reserved;
+    long long offset[DC_NUM_SECTIONS]; // page aligned, from the start of the file
+    long long size[DC_NUM_SECTIONS];
+} dataset_cache_header_t;
+
+typedef struct {
+    const unsigned char *dataset;
+    const unsigned char *dataset_t;
+    const int *norm;
+    const int *pyr_l0;
+    const unsigned short *pyr_l1, *pyr_l2;
+
+    int num_images, tile;
+    int image_size;           // 3 * tile * tile
+    int padd_rows, padd_cols; // num_images rounded up to the alignments above
+
+    void *map;       // mmap'ed cache file, or NULL
+    size_t map_size;
+    unsigned char *buf; // raw dataset read without a cache, or NULL
+} dataset_cache_t;
+
+/* tile is a power of two in [DATASET_MIN_TILE, DATASET_MAX_TILE] */
+int dataset_tile_valid(int tile);
+int dataset_padd(int n, int align);
+
+/* cache file next to raw_path, "x.bin" -> "x.cache" */
+void dataset_cache_path(char *cache_path, size_t size, const char *raw_path);
+
+/*
+ * map cache_path if it is a valid cache file of tile x tile images,
+ * otherwise read raw_path, whose size gives num_images
+ * returns 0 on success, -1 if neither can be loaded
+ */
+int dataset_cache_open(dataset_cache_t *cache, const char *cache_path, const char *raw_path, int tile);
+void dataset_cache_close(dataset_cache_t *cache);
@@ -5,126 +5,127 @@
 #include <omp.h>
 
 #include "photomosaic.h"
+#include "gemm.h"
 #include "timer.h"
+#include "tile_memo.h"
 
 typedef unsigned char uchar;
 #define NUM_THREADS 32
-#define TSIZE 16
-
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx) {
-    int swidth = width / 32, sheight = height / 32;
-    const int P = 60416;
-    const int Q = 3 * 32 * 32;
-    const int R = (swidth * sheight + TSIZE - 1) / TSIZE * TSIZE;
-    
-    timer_start(1);
-    int *diff_all = (int*)malloc(sizeof(int) * P * R);
-    int *min_diff = (int*)malloc(sizeof(int) * R);
-    uchar *img_t = (uchar*)malloc(sizeof(uchar) * Q * R);
-    uchar *dataset_p = (uchar*)malloc(sizeof(uchar) * P * Q);
-    printf("P = %d, Q = %d, R = %d\n", P, Q, R);
-    #pragma omp parallel num_threads(NUM_THREADS)
-    {
-        #pragma omp for collapse(2) nowait
-        for (int sh = 0; sh < sheight; ++sh) {
-            for (int sw = 0; sw < swidth; ++sw) {
-                for (int h = 0; h < 32; ++h) {
-                    for (int w = 0; w < 32; ++w) {
-                        for (int c = 0; c < 3; ++c) {
-                            img_t[(c * 32 * 32 + h * 32 + w) * R + (sh * swidth + sw)] = img[(sh * 32 + h) * width * 3 + (sw * 32 + w) * 3 + c];
-                        }
-                    }
-                }
-            }
-        }
+#define TSIZE GEMM_TSIZE
 
-        #pragma omp for schedule(guided) collapse(2) nowait
-        for (int i = 0; i < Q; ++i) {
-            for (int j = swidth * sheight; j < R; ++j) {
-                img_t[i * R + j] = 0;
-            }
-        }
-        #pragma omp for schedule(guided) nowait
-        for (int i = 0; i < 60000 * Q; ++i)
-            dataset_p[i] = dataset[i];
-        #pragma omp for schedule(guided) nowait
-        for (int i = 60000 * Q; i < P * Q; ++i)
-            dataset_p[i] = 0;
-        #pragma omp for schedule(guided) nowait
-        for (int i = 0; i < R; ++i)
-            min_diff[i] = INT_MAX;
+static const uchar *dataset_p;
+static const int *norm_dataset;
+static int *norm_buf;
+static int T, num_images, P, Q;
+
+/* matches of repeated tiles, kept across photomosaic_run() calls */
+static tile_memo_t memo;
+
+void photomosaic_init(const dataset_cache_t *cache) {
+    T = cache->tile;
+    num_images = cache->num_images;
+    P = cache->padd_rows;
+    Q = cache->image_size;
+
+    // the dataset already comes padded to P rows, mapped or read
+    dataset_p = cache->dataset;
+    tile_memo_init(&memo, cache, 1);
+    norm_dataset = cache->norm;
+    if (!norm_dataset) {
+        timer_start(4);
+        norm_buf = (int*)malloc(sizeof(int) * P);
+        sqnorm_rows(dataset_p, P, Q, norm_buf);
+        norm_dataset = norm_buf;
+        printf("dataset norms: %f seconds\n", timer_stop(4));
     }
-    printf("\nprepare diff_all & img_t & dataset_p: %f seconds\n", timer_stop(1));
+}
 
-    timer_start(2);
-    #pragma omp parallel num_threads(NUM_THREADS)
-    {
-        int asub[TSIZE][TSIZE], bsub[TSIZE][TSIZE], csub[TSIZE][TSIZE];
-        const int ii_chunk = P / TSIZE / NUM_THREADS;
-        const int NUM_TILES = Q / TSIZE;
-    
-        int id = omp_get_thread_num();
-        for (int ii = id * ii_chunk; ii < (id + 1) * ii_chunk; ++ii) {
-            for (int jj = 0; jj < R / TSIZE; ++jj) {
-                // init csub <- 0
-                memset(csub, 0, sizeof(csub));
-
-                for (int t = 0; t < NUM_TILES; ++t) {
-                    // load asub, bsub <- a, b
-                    for (int i = 0; i < TSIZE; ++i) {
-                        for (int j = 0; j < TSIZE; ++j) {
-                            asub[i][j] = (int)dataset_p[(ii * TSIZE + i) * Q + (t * TSIZE + j)];
-                            bsub[i][j] = (int)img_t[(t * TSIZE + i) * R + (jj * TSIZE + j)];
-                        }
-                    }
-                    // calculate csub
-                    for (int i = 0; i < TSIZE; ++i) {
-                        for (int j = 0; j < TSIZE; ++j) {
-                            for (int k = 0; k < TSIZE; ++k) {
-                                int a = asub[i][k];
-                                int b = bsub[k][j];
-                                csub[i][j] += (a - b) * (a - b);
-                            }
-                        }
-                    }
-                }
+void photomosaic_release() {
+    tile_memo_release(&memo);
+    free(norm_buf);
+    norm_buf = NULL;
+}
 
-                // store csub -> c
-                for (int i = 0; i < TSIZE; ++i) {
-                    for (int j = 0; j < TSIZE; ++j) {
-                        size_t li = ii * TSIZE + i;
-                        size_t lj = jj * TSIZE + j;
-                        diff_all[li * R + lj] = csub[i][j];
+/*
+ * packed[offset + tile][c][h][w] = img[tile's pixel][c], for every tile of one image
+ */
+static void pack_tiles(const uchar *img, int width, int height, uchar *packed, int offset) {
+    int swidth = width / T, sheight = height / T;
+    #pragma omp parallel for collapse(2) num_threads(NUM_THREADS)
+    for (int sh = 0; sh < sheight; ++sh) {
+        for (int sw = 0; sw < swidth; ++sw) {
+            for (int c = 0; c < 3; ++c) {
+                for (int h = 0; h < T; ++h) {
+                    for (int w = 0; w < T; ++w) {
+                        packed[(size_t)(offset + sh * swidth + sw) * Q + (c * T + h) * T + w] = img[(sh * T + h) * width * 3 + (sw * T + w) * 3 + c];
                     }
                 }
             }
         }
     }
-    printf("mat_mul: %f seconds\n", timer_stop(2));
-
-    timer_start(3);
-    #pragma omp parallel num_threads(NUM_THREADS)
-    {
-        #pragma omp for schedule(guided)
-        for (int i = 0; i < 60000; ++i) {
-            for (int sh = 0; sh < sheight; ++sh) {
-                for (int sw = 0; sw < swidth; ++sw) {
-                    size_t li = i;
-                    size_t lj = sh * swidth + sw;
-
-                    int diff = diff_all[li * R + lj];
-                    if (diff < min_diff[lj]) {
-                        min_diff[lj] = diff;
-                        idx[lj] = i;
-                    }
-                }
-            }
+}
+
+void photomosaic_run(unsigned char *img, int width, int height, int *idx) {
+    photomosaic_run_batch(1, &img, &width, &height, &idx);
+}
+
+void photomosaic_run_batch(int n, unsigned char **imgs, const int *widths, const int *heights, int **idx) {
+    int num_tiles = 0;
+    for (int b = 0; b < n; ++b) {
+        num_tiles += (widths[b] / T) * (heights[b] / T);
+    }
+
+    timer_start(1);
+    // tiles of all images back to back, so the dataset is streamed only once;
+    // repeated tiles are dropped before they are laid out for gemm
+    uchar *packed = (uchar*)malloc(sizeof(uchar) * Q * (size_t)num_tiles);
+    for (int b = 0, offset = 0; b < n; ++b) {
+        pack_tiles(imgs[b], widths[b], heights[b], packed, offset);
+        offset += (widths[b] / T) * (heights[b] / T);
+    }
+    const int num_match = tile_memo_begin(&memo, packed, num_tiles);
+    const int R = (num_match + TSIZE - 1) / TSIZE * TSIZE;
+
+    int *min_diff = (int*)malloc(sizeof(int) * R);
+    int *idx_all = (int*)malloc(sizeof(int) * (num_tiles > R ? num_tiles : R));
+    uchar *img_t = (uchar*)malloc(sizeof(uchar) * Q * (size_t)R);
+    int *norm_img = (int*)malloc(sizeof(int) * R);
+    printf("P = %d, Q = %d, R = %d (%d images, %d of %d tiles to match)\n", P, Q, R, n, num_match, num_tiles);
+
+    // gemm_u8_argmin takes the tiles as columns, img_t[q][t] = packed[t][q]
+    #pragma omp parallel for schedule(static) num_threads(NUM_THREADS)
+    for (int i = 0; i < Q; ++i) {
+        for (int j = 0; j < R; ++j) {
+            img_t[(size_t)i * R + j] = (j < num_match) ? packed[(size_t)j * Q + i] : 0;
         }
     }
-    printf("set idx: %f seconds\n\n", timer_stop(3));
+    free(packed);
+    printf("\nprepare img_t: %f seconds\n", timer_stop(1));
+
+    /*
+     * |a - b|^2 = |a|^2 + |b|^2 - 2 * a.b
+     * dataset norms are computed once, and only the cross term goes through gemm
+     */
+    timer_start(4);
+    sqnorm_cols(img_t, Q, R, norm_img);
+    printf("tile norms: %f seconds\n", timer_stop(4));
+
+    timer_start(2);
+    if (num_match > 0) {
+        gemm_u8_argmin(dataset_p, img_t, norm_dataset, norm_img, num_images, num_match,
+            P, Q, R, min_diff, idx_all);
+    }
+    printf("mat_mul & set idx: %f seconds\n\n", timer_stop(2));
+    tile_memo_end(&memo, idx_all);
+
+    for (int b = 0, offset = 0; b < n; ++b) {
+        int tiles = (widths[b] / T) * (heights[b] / T);
+        memcpy(idx[b], idx_all + offset, sizeof(int) * tiles);
+        offset += tiles;
+    }
 
-    free(diff_all);
     free(min_diff);
+    free(idx_all);
     free(img_t);
-    free(dataset_p);
+    free(norm_img);
 }
@@ -1,3 +1,18 @@
 #pragma once
 
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx);
+#include "dataset_cache.h"
+
+/*
+ * the dataset (and devices) are set up once in photomosaic_init(),
+ * so a resident process can match many images with photomosaic_run()
+ */
+void photomosaic_init(const dataset_cache_t *cache);
+void photomosaic_run(unsigned char *img, int width, int height, int *idx);
+
+/*
+ * match the tiles of n images in a single pass over the dataset;
+ * idx[b] receives the (height[b] / T) x (width[b] / T) results of imgs[b],
+ * T being the tile of the cache given to photomosaic_init()
+ */
+void photomosaic_run_batch(int n, unsigned char **imgs, const int *widths, const int *heights, int **idx);
+void photomosaic_release();
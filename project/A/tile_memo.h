@@ -0,0 +1,83 @@
+#pragma once
+
+#include "dataset_cache.h"
+
+/*
+ * memoization of tile matches by content: the input tiles are hashed, only
+ * the first of each group of identical tiles is matched, and its result is
+ * copied to the others; flat sky, borders and screenshots repeat many tiles
+ *
+ * with resident (all requests of a resident server) or -DTILE_MEMO_PERSIST=1
+ * (across runs, in TILE_MEMO_PATH) results are also kept in a table keyed
+ * by tile hash; the file records the tile size and a hash of the dataset,
+ * and is ignored when either differs; a one-shot run keeps no table
+ *
+ * within a run, tiles with equal hashes are compared byte for byte; a hit
+ * in the table of earlier results trusts the 128-bit hash alone, the tiles
+ * behind it are not kept
+ *
+ *     int m = tile_memo_begin(&memo, img_t, num_tiles);
+ *     ... match img_t[0 .. m) into idx[0 .. m) ...
+ *     tile_memo_end(&memo, idx); // idx[0 .. num_tiles)
+ */
+#ifndef TILE_MEMO
+#define TILE_MEMO 1
+#endif
+
+#ifndef TILE_MEMO_PERSIST
+#define TILE_MEMO_PERSIST 0
+#endif
+
+#define TILE_MEMO_PATH "tile_memo.bin"
+#define TILE_MEMO_MAGIC "MC17TMO"
+#define TILE_MEMO_VERSION 1
+#define TILE_MEMO_MAX_ENTRIES (1 << 22) // the table stops growing here
+
+typedef struct {
+    unsigned long long h1, h2;
+    int idx; // -1 for an empty slot
+} tile_memo_entry_t;
+
+typedef struct {
+    char magic[8];
+    int version;
+    int tile, num_images;
+    int reserved;
+    unsigned long long dataset_hash;
+    long long count;
+} tile_memo_header_t;
+
+typedef struct {
+    int tile_size;
+    int tile, num_images;
+    unsigned long long dataset_hash;
+
+    // results of earlier runs, open addressing over capacity (a power of two)
+    tile_memo_entry_t *table;
+    long long capacity, count;
+    int keep; // results go into the table
+    int dirty;
+
+    // the current run, between tile_memo_begin() and tile_memo_end()
+    int num_tiles, num_unique, num_match;
+    unsigned long long *hash; // [num_tiles][2]
+    int *of;                  // distinct tile of each tile
+    int *first;               // [num_unique], first tile of a distinct tile
+    int *result;              // [num_unique], its match
+    int *pos;                 // [num_unique], its position in img_t, -1 if known
+} tile_memo_t;
+
+/* resident: the tile_memo_t serves more than one run */
+void tile_memo_init(tile_memo_t *memo, const dataset_cache_t *cache, int resident);
+
+/*
+ * img_t holds num_tiles tiles of 3 x tile x tile pixels, tile-major;
+ * moves the tiles to be matched to img_t[0 .. m) and returns m
+ */
+int tile_memo_begin(tile_memo_t *memo, unsigned char *img_t, int num_tiles);
+
+/* idx[0 .. m) holds the matches of img_t[0 .. m); fills idx[0 .. num_tiles) */
+void tile_memo_end(tile_memo_t *memo, int *idx);
+
+/* saves the table with TILE_MEMO_PERSIST */
+void tile_memo_release(tile_memo_t *memo);
@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include "bmp_stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define BMP_HEADER_SIZE 54
+
+static unsigned get_u16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static unsigned get_u32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+static void put_u16(unsigned char *p, unsigned x)
+{
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+}
+
+static void put_u32(unsigned char *p, unsigned x)
+{
+    put_u16(p, x & 0xffff);
+    put_u16(p + 2, x >> 16);
+}
+
+static int init_rows(bmp_stream_t *s, int width, int height)
+{
+    s->width = width;
+    s->height = height;
+    s->row_size = (width * 3 + 3) / 4 * 4;
+    s->row = (unsigned char*)calloc(s->row_size, 1);
+    return s->row ? 0 : -1;
+}
+
+/* file offset of the top-to-bottom row y */
+static off_t row_offset(const bmp_stream_t *s, int y)
+{
+    int stored = s->bottom_up ? s->height - 1 - y : y;
+    return (off_t)s->data_offset + (off_t)stored * s->row_size;
+}
+
+int bmp_stream_open_read(bmp_stream_t *s, const char *path)
+{
+    memset(s, 0, sizeof(*s));
+    s->file = fopen(path, "rb");
+    if (!s->file) {
+        printf("BMP error: cannot open %s\n", path);
+        return -1;
+    }
+
+    unsigned char h[BMP_HEADER_SIZE];
+    if (fread(h, 1, BMP_HEADER_SIZE, s->file) != BMP_HEADER_SIZE || h[0] != 'B' || h[1] != 'M'
+        || get_u16(h + 28) != 24 || get_u32(h + 30) != 0) {
+        printf("BMP error: %s is not an uncompressed 24-bit BMP\n", path);
+        fclose(s->file);
+        s->file = NULL;
+        return -1;
+    }
+
+    int width = (int)get_u32(h + 18), height = (int)get_u32(h + 22);
+    s->bottom_up = height > 0;
+    s->data_offset = get_u32(h + 10);
+    if (init_rows(s, width, height > 0 ? height : -height) != 0) {
+        fclose(s->file);
+        s->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int bmp_stream_open_write(bmp_stream_t *s, const char *path, int width, int height)
+{
+    memset(s, 0, sizeof(*s));
+    s->file = fopen(path, "wb");
+    if (!s->file) {
+        printf("BMP error: cannot open %s\n", path);
+        return -1;
+    }
+    s->bottom_up = 1;
+    s->data_offset = BMP_HEADER_SIZE;
+    if (init_rows(s, width, height) != 0) {
+        fclose(s->file);
+        s->file = NULL;
+        return -1;
+    }
+
+    unsigned image_size = (unsigned)s->row_size * height;
+    unsigned char h[BMP_HEADER_SIZE];
+    memset(h, 0, sizeof(h));
+    h[0] = 'B';
+    h[1] = 'M';
+    put_u32(h + 2, image_size + BMP_HEADER_SIZE); // file size
+    put_u32(h + 10, BMP_HEADER_SIZE);             // data offset
+    put_u32(h + 14, 40);                          // info header size
+    put_u32(h + 18, width);
+    put_u32(h + 22, height);
+    put_u16(h + 26, 1);                           // planes
+    put_u16(h + 28, 24);                          // bits per pixel
+    put_u32(h + 34, image_size);
+    if (fwrite(h, 1, BMP_HEADER_SIZE, s->file) != BMP_HEADER_SIZE) {
+        printf("BMP error: cannot write %s\n", path);
+        bmp_stream_close(s);
+        return -1;
+    }
+    return 0;
+}
+
+int bmp_stream_read_rows(bmp_stream_t *s, int y, int n, unsigned char *img)
+{
+    for (int i = 0; i < n; ++i) {
+        if (fseeko(s->file, row_offset(s, y + i), SEEK_SET) != 0
+            || fread(s->row, 1, s->row_size, s->file) != (size_t)s->row_size) {
+            printf("BMP error: cannot read row %d\n", y + i);
+            return -1;
+        }
+        unsigned char *out = img + (size_t)i * s->width * 3;
+        for (int x = 0; x < s->width; ++x) {
+            // stored as BGR
+            out[x * 3 + 0] = s->row[x * 3 + 2];
+            out[x * 3 + 1] = s->row[x * 3 + 1];
+            out[x * 3 + 2] = s->row[x * 3 + 0];
+        }
+    }
+    return 0;
+}
+
+int bmp_stream_write_rows(bmp_stream_t *s, int y, int n, const unsigned char *img)
+{
+    for (int i = 0; i < n; ++i) {
+        const unsigned char *in = img + (size_t)i * s->width * 3;
+        for (int x = 0; x < s->width; ++x) {
+            s->row[x * 3 + 0] = in[x * 3 + 2];
+            s->row[x * 3 + 1] = in[x * 3 + 1];
+            s->row[x * 3 + 2] = in[x * 3 + 0];
+        }
+        if (fseeko(s->file, row_offset(s, y + i), SEEK_SET) != 0
+            || fwrite(s->row, 1, s->row_size, s->file) != (size_t)s->row_size) {
+            printf("BMP error: cannot write row %d\n", y + i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bmp_stream_close(bmp_stream_t *s)
+{
+    int ret = 0;
+    if (s->file && fclose(s->file) != 0) ret = -1;
+    free(s->row);
+    memset(s, 0, sizeof(*s));
+    return ret;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * row-band access to uncompressed 24-bit BMP files, for images that do not
+ * fit in memory as a whole (qdbmp always loads the full pixel array)
+ *
+ * rows are numbered top to bottom as in qdbmp, and a band of n rows is
+ * exchanged as img[n][width][3] in RGB order; only one band is ever held
+ */
+typedef struct {
+    FILE *file;
+    int width, height;
+    int bottom_up;       // rows stored last to first, the usual case
+    long long data_offset;
+    int row_size;        // bytes per stored row, padded to a multiple of 4
+    unsigned char *row;  // one stored row
+} bmp_stream_t;
+
+/* returns 0 on success, -1 (with a message) if path is not a 24-bit BMP */
+int bmp_stream_open_read(bmp_stream_t *s, const char *path);
+
+/* writes the header of a width x height 24-bit BMP, laid out as qdbmp does */
+int bmp_stream_open_write(bmp_stream_t *s, const char *path, int width, int height);
+
+/* rows [y, y + n) */
+int bmp_stream_read_rows(bmp_stream_t *s, int y, int n, unsigned char *img);
+int bmp_stream_write_rows(bmp_stream_t *s, int y, int n, const unsigned char *img);
+
+/* returns -1 if a buffered write failed */
+int bmp_stream_close(bmp_stream_t *s);
@@ -1,100 +1,271 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "photomosaic.h"
+#include "bmp_stream.h"
+#include "server.h"
 #include "timer.h"
 #include "qdbmp.h"
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage : %s [input.bmp] [output.bmp]\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+// a streamed band holds at least one row of tiles and about this many tiles,
+// so that every pass over the dataset still matches a full batch
+#define STREAM_BAND_TILES 1024
 
-    /*
-     * read input image
-     */
+static dataset_cache_t cache;
 
-    BMP *bmp = BMP_ReadFile(argv[1]);
-    BMP_CHECK_ERROR(stderr, EXIT_FAILURE);
+/*
+ * read input image into img[height][width][3], NULL on error
+ */
+static unsigned char *read_image(const char *path, int *width, int *height, int *depth) {
+    BMP *bmp = BMP_ReadFile(path);
+    BMP_CHECK_ERROR(stderr, NULL);
 
-    int width = BMP_GetWidth(bmp);
-    int height = BMP_GetHeight(bmp);
-    int depth = BMP_GetDepth(bmp);
-    printf("image read success; image = %s, width = %d, height = %d, depth = %d\n", argv[1], width, height, depth);
-    if (width % 32 != 0 || height % 32 != 0) {
-        printf("width and height should be multiple of 32.\n");
-        exit(EXIT_FAILURE);
+    *width = BMP_GetWidth(bmp);
+    *height = BMP_GetHeight(bmp);
+    *depth = BMP_GetDepth(bmp);
+    printf("image read success; image = %s, width = %d, height = %d, depth = %d\n", path, *width, *height, *depth);
+    if (*width % cache.tile != 0 || *height % cache.tile != 0) {
+        printf("width and height should be multiple of %d.\n", cache.tile);
+        BMP_Free(bmp);
+        return NULL;
     }
-    if (depth != 24) {
+    if (*depth != 24) {
         printf("depth should be 24.\n");
-        exit(EXIT_FAILURE);
+        BMP_Free(bmp);
+        return NULL;
     }
 
-    unsigned char *img = (unsigned char*)malloc(height * width * 3), *it = img;
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
+    unsigned char *img = (unsigned char*)malloc(*height * *width * 3), *it = img;
+    for (int i = 0; i < *height; ++i) {
+        for (int j = 0; j < *width; ++j) {
             BMP_GetPixelRGB(bmp, j, i, it, it + 1, it + 2);
             it += 3;
         }
     }
 
     BMP_Free(bmp);
+    return img;
+}
 
-    /*
-     * read cifar-10 dataset
-     */
+/*
+ * construct output image from the matched dataset images
+ */
+static int write_image(const char *path, int width, int height, int depth, const int *idx) {
+    const unsigned char *dataset = cache.dataset;
+    const int T = cache.tile;
+    int swidth = width / T, sheight = height / T;
 
-    unsigned char *dataset = (unsigned char*)malloc(60000 * 3 * 32 * 32);
-    FILE *fin = fopen("data/cifar-10.bin", "rb");
-    if (!fin) {
-        printf("cifar-10.bin not found\n");
-        exit(EXIT_FAILURE);
+    BMP *bmp = BMP_Create(width, height, depth);
+    BMP_CHECK_ERROR(stderr, -1);
+    for (int sh = 0; sh < sheight; ++sh) {
+        for (int sw = 0; sw < swidth; ++sw) {
+            for (int h = 0; h < T; ++h) {
+                for (int w = 0; w < T; ++w) {
+                    unsigned char rgb[3];
+                    for (int c = 0; c < 3; ++c) {
+                        rgb[c] = dataset[(((size_t)idx[sh * swidth + sw] * 3 + c) * T + h) * T + w];
+                    }
+                    BMP_SetPixelRGB(bmp, sw * T + w, sh * T + h, rgb[0], rgb[1], rgb[2]);
+                }
+            }
+        }
     }
-    fread(dataset, 1, 60000 * 3 * 32 * 32, fin);
-    fclose(fin);
-
-    printf("dataset read success\n");
+    BMP_WriteFile(bmp, path);
+    if (BMP_GetError() != BMP_OK) {
+        fprintf(stderr, "BMP error: %s\n", BMP_GetErrorDescription());
+        BMP_Free(bmp);
+        return -1;
+    }
+    BMP_Free(bmp);
+    printf("image write success\n");
+    return 0;
+}
 
-    /*
-     * photomosaic computation
-     */
+static int process_image(const char *input, const char *output) {
+    int width, height, depth;
+    unsigned char *img = read_image(input, &width, &height, &depth);
+    if (!img) return -1;
 
-    int swidth = width / 32, sheight = height / 32;
+    int swidth = width / cache.tile, sheight = height / cache.tile;
     int *idx = (int*)malloc(sheight * swidth * sizeof(int));
     timer_start(0);
-    photomosaic(img, width, height, dataset, idx);
+    photomosaic_run(img, width, height, idx);
     printf("Elapsed time: %f sec\n", timer_stop(0));
 
-    /*
-     * construct output image
-     */
+    int ret = write_image(output, width, height, depth, idx);
+    free(img);
+    free(idx);
+    return ret;
+}
 
-    bmp = BMP_Create(width, height, depth);
-    for (int sh = 0; sh < sheight; ++sh) {
-        for (int sw = 0; sw < swidth; ++sw) {
-            for (int h = 0; h < 32; ++h) {
-                for (int w = 0; w < 32; ++w) {
-                    unsigned char rgb[3];
-                    for (int c = 0; c < 3; ++c) {
-                        rgb[c] = dataset[((idx[sh * swidth + sw] * 3 + c) * 32 + h) * 32 + w];
+/*
+ * gigapixel mode : the input is read, matched and written back one band of
+ * tile rows at a time, so memory stays proportional to a band, not the image
+ */
+static int process_stream(const char *input, const char *output) {
+    const int T = cache.tile;
+    bmp_stream_t in, out;
+    if (bmp_stream_open_read(&in, input) != 0) return -1;
+    const int width = in.width, height = in.height;
+    printf("image open success; image = %s, width = %d, height = %d, depth = 24\n", input, width, height);
+    if (width % T != 0 || height % T != 0) {
+        printf("width and height should be multiple of %d.\n", T);
+        bmp_stream_close(&in);
+        return -1;
+    }
+    if (bmp_stream_open_write(&out, output, width, height) != 0) {
+        bmp_stream_close(&in);
+        return -1;
+    }
+
+    const int swidth = width / T, sheight = height / T;
+    int band_rows = STREAM_BAND_TILES / swidth;
+    if (band_rows < 1) band_rows = 1;
+    unsigned char *band = (unsigned char*)malloc((size_t)band_rows * T * width * 3);
+    int *idx = (int*)malloc(sizeof(int) * band_rows * swidth);
+    printf("streaming %d tile rows per band (%d bands)\n", band_rows, (sheight + band_rows - 1) / band_rows);
+
+    int ret = 0;
+    timer_start(0);
+    for (int sh = 0; sh < sheight && ret == 0; sh += band_rows) {
+        const int rows = sh + band_rows < sheight ? band_rows : sheight - sh;
+        if (bmp_stream_read_rows(&in, sh * T, rows * T, band) != 0) {
+            ret = -1;
+            break;
+        }
+        photomosaic_run(band, width, rows * T, idx);
+
+        // the band buffer is reused for the output pixels
+        for (int r = 0; r < rows; ++r) {
+            for (int sw = 0; sw < swidth; ++sw) {
+                const unsigned char *src = cache.dataset + (size_t)idx[r * swidth + sw] * cache.image_size;
+                for (int c = 0; c < 3; ++c) {
+                    for (int h = 0; h < T; ++h) {
+                        for (int w = 0; w < T; ++w) {
+                            band[((size_t)(r * T + h) * width + sw * T + w) * 3 + c] = src[(c * T + h) * T + w];
+                        }
                     }
-                    BMP_SetPixelRGB(bmp, sw * 32 + w, sh * 32 + h, rgb[0], rgb[1], rgb[2]);
                 }
             }
         }
+        if (bmp_stream_write_rows(&out, sh * T, rows * T, band) != 0) ret = -1;
     }
-    BMP_WriteFile(bmp, argv[2]);
-    BMP_Free(bmp);
-    printf("image write success\n");
+    printf("Elapsed time: %f sec\n", timer_stop(0));
+
+    free(band);
+    free(idx);
+    bmp_stream_close(&in);
+    if (bmp_stream_close(&out) != 0) ret = -1;
+    if (ret == 0) printf("image write success\n");
+    return ret;
+}
+
+/*
+ * paths = {input0, output0, input1, output1, ...}; images that fail to read
+ * are skipped, the rest are matched together in one photomosaic_run_batch()
+ */
+static int process_batch(int n, char **paths) {
+    unsigned char **imgs = (unsigned char**)malloc(sizeof(unsigned char*) * n);
+    int **idx = (int**)malloc(sizeof(int*) * n);
+    int *widths = (int*)malloc(sizeof(int) * n);
+    int *heights = (int*)malloc(sizeof(int) * n);
+    int *depths = (int*)malloc(sizeof(int) * n);
+    char **outputs = (char**)malloc(sizeof(char*) * n);
+    int count = 0, ret = 0;
+
+    for (int i = 0; i < n; ++i) {
+        imgs[count] = read_image(paths[2 * i], &widths[count], &heights[count], &depths[count]);
+        if (!imgs[count]) {
+            ret = -1;
+            continue;
+        }
+        idx[count] = (int*)malloc(sizeof(int) * (widths[count] / cache.tile) * (heights[count] / cache.tile));
+        outputs[count] = paths[2 * i + 1];
+        ++count;
+    }
+
+    if (count > 0) {
+        timer_start(0);
+        photomosaic_run_batch(count, imgs, widths, heights, idx);
+        printf("Elapsed time: %f sec (%d images)\n", timer_stop(0), count);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (write_image(outputs[i], widths[i], heights[i], depths[i], idx[i]) != 0) ret = -1;
+        free(imgs[i]);
+        free(idx[i]);
+    }
+    free(imgs);
+    free(idx);
+    free(widths);
+    free(heights);
+    free(depths);
+    free(outputs);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    /*
+     * options : -t tile size, -d tile library (its cache file is looked up next to it)
+     */
+    int tile = DATASET_DEFAULT_TILE;
+    const char *dataset_path = DATASET_DEFAULT_PATH;
+    while (argc > 3 && (strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "-d") == 0)) {
+        if (argv[1][1] == 't') tile = atoi(argv[2]);
+        else dataset_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+
+    int server = argc == 3 && strcmp(argv[1], "-s") == 0;
+    int stream = argc == 4 && strcmp(argv[1], "-g") == 0;
+    int batch = argc >= 4 && argc % 2 == 0 && strcmp(argv[1], "-b") == 0;
+    if (argc != 3 && !stream && !batch) {
+        printf("Usage : %s [-t tile] [-d dataset.bin] [input.bmp] [output.bmp]\n", argv[0]);
+        printf("        %s [-t tile] [-d dataset.bin] -s [socket]    (resident server mode, see server.h)\n", argv[0]);
+        printf("        %s [-t tile] [-d dataset.bin] -b [input.bmp] [output.bmp] ...    (match all inputs in one pass)\n", argv[0]);
+        printf("        %s [-t tile] [-d dataset.bin] -g [input.bmp] [output.bmp]    (stream bands of huge images)\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * read the tile library
+     */
+
+    char cache_path[4096];
+    dataset_cache_path(cache_path, sizeof(cache_path), dataset_path);
+    if (dataset_cache_open(&cache, cache_path, dataset_path, tile) != 0) {
+        printf("%s not found\n", dataset_path);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("dataset read success; %d images of %d x %d%s\n", cache.num_images, tile, tile, cache.map ? " (mapped cache)" : "");
+
+    /*
+     * photomosaic computation
+     */
+
+    timer_start(0);
+    photomosaic_init(&cache);
+    printf("photomosaic init: %f sec\n", timer_stop(0));
+
+    int ret;
+    if (server)
+        ret = serve(argv[2], process_image);
+    else if (stream)
+        ret = process_stream(argv[2], argv[3]);
+    else if (batch)
+        ret = process_batch((argc - 2) / 2, argv + 2);
+    else
+        ret = process_image(argv[1], argv[2]);
 
     /*
      * free resources
      */
 
-    free(img);
-    free(dataset);
-    free(idx);
+    photomosaic_release();
+    dataset_cache_close(&cache);
 
-    return 0;
+    return ret == 0 ? 0 : EXIT_FAILURE;
 }
@@ -1,5 +1,8 @@
 #include "photomosaic.h"
 #include "timer.h"
+#include "kernel_cache.h"
+#include "tuning.h"
+#include "tile_memo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +14,23 @@
 #define BATCH_SIZE 1024
 #define NUM_THREADS 32
 
+/*
+ * batches in flight (see trunk/opencl_buffering): batch i + 1 is uploaded
+ * while batch i runs conv/reduction and batch i - 1 is read back, on
+ * separate write/compute/read queues; 1 runs batches back to back
+ */
+#ifndef NUM_BUFFERS
+#define NUM_BUFFERS 2
+#endif
+
+/*
+ * 1 runs conv_vec / conv_argmin_vec, the variants of conv / conv_argmin that
+ * keep tiles packed as uchar and use vector loads and math (-DCONV_VEC=1)
+ */
+#ifndef CONV_VEC
+#define CONV_VEC 0
+#endif
+
 typedef unsigned char uchar;
 #define CHECK_ERROR(err) \
     if (err != CL_SUCCESS) { \
@@ -22,96 +42,138 @@ typedef unsigned char uchar;
 cl_platform_id platform;
 cl_device_id device;
 cl_context context;
-cl_command_queue queue;
+cl_command_queue queue; // compute, and the one-time dataset upload
+cl_command_queue queue_write, queue_read;
 cl_program program;
 cl_kernel kernel_conv, kernel_reduce;
+cl_kernel kernel_reduce_final; // NULL if the program lacks it
+cl_kernel kernel_conv_argmin;  // NULL if the program lacks it, or reduction_final
 cl_kernel kernel_transpose;
 
 cl_mem buf_img, buf_dataset;
-cl_mem buf_img_t, buf_dataset_t;
-cl_mem buf_diff, buf_idx;
-cl_mem buf_diff_reduced, buf_idx_reduced;
+cl_mem buf_img_t[NUM_BUFFERS], buf_dataset_t;
+cl_mem buf_diff, buf_idx[NUM_BUFFERS]; // no buf_diff with conv_argmin
+cl_mem buf_diff_reduced[NUM_BUFFERS], buf_idx_reduced[NUM_BUFFERS];
+cl_event write_event[NUM_BUFFERS], kernel_event[NUM_BUFFERS], read_event[NUM_BUFFERS];
 cl_int err;
 
-int *diff_reduced, *idx_reduced;
+int *diff_reduced[NUM_BUFFERS], *idx_reduced[NUM_BUFFERS];
+
+/* tile library geometry, from the dataset cache */
+static int T, num_filters, padd_filters, filter_size;
+
+/* kernel configuration for this device, from TUNING_DB_PATH if tuned */
+static tuning_t tuning = TUNING_DEFAULT;
+
+/* matches of repeated tiles, kept across photomosaic_run() calls */
+static tile_memo_t memo;
 
-char *get_source_code(const char *file_name, size_t *len);
-uchar *get_binary(const char *file_name, size_t *len);
 void setup_opencl(int width, int height);
 void release_opencl();
 size_t round_work_size(size_t work_size, size_t group_size);
 void set_work_size_rounded(size_t *work_size, size_t *group_size, int n);
 
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx)
+/*
+ * partial minima per tile left for reduction_final or the host:
+ * conv_argmin leaves one per ts columns, reduction one per reduce_wg
+ */
+static int num_partials()
 {
-    const int swidth = width / 32, sheight = height / 32;
-    const int batch_size = BATCH_SIZE;
-    const int num_tiles = sheight * swidth;
-    const int filter_size = 3 * 32 * 32;
-    const int num_filters = 60000;
-    const int reduction_count = (num_filters + 255) / 256;
-    diff_reduced = (int*)malloc(sizeof(int) * batch_size * reduction_count);
-    idx_reduced = (int*)malloc(sizeof(int) * batch_size * reduction_count);
+    if (kernel_conv_argmin) return padd_filters / tuning.ts;
+    return (num_filters + tuning.reduce_wg - 1) / tuning.reduce_wg;
+}
 
+void photomosaic_init(const dataset_cache_t *cache)
+{
+    T = cache->tile;
+    num_filters = cache->num_images;
+    padd_filters = cache->padd_cols;
+    filter_size = cache->image_size;
+    tile_memo_init(&memo, cache, 1);
+
+    const int batch_size = BATCH_SIZE;
     timer_start(1);
-    setup_opencl(batch_size, num_filters + 32);
+    setup_opencl(batch_size, padd_filters);
     printf("\nsetup opencl : %f seconds\n\n", timer_stop(1));
 
-    uchar *img_t = (uchar*)malloc(sizeof(uchar) * num_tiles * filter_size);
-    #pragma omp parallel num_threads(NUM_THREADS)
-    {
-        #pragma omp for schedule(guided) collapse(2)
-        for (int sh = 0; sh < sheight; ++sh) {
-            for (int sw = 0; sw < swidth; ++sw) {
-                for (int c = 0; c < 3; ++c) {
-                    for (int h = 0; h < 32; ++h) {
-                        for (int w = 0; w < 32; ++w) {
-                            // img_t[sh][sw][c][h][w] = img[sh * 32 + h][sw * 32 + w][c]
-                            img_t[(sh * swidth + sw) * filter_size + (c * 32 + h) * 32 + w] = img[(sh * 32 + h) * width * 3 + (sw * 32 + w) * 3 + c];
-                        }
-                    }
-                }
-            }
-        }
+    const int reduction_count = num_partials();
+    for (int b = 0; b < NUM_BUFFERS; ++b) {
+        diff_reduced[b] = (int*)malloc(sizeof(int) * batch_size * reduction_count);
+        idx_reduced[b] = (int*)malloc(sizeof(int) * batch_size * reduction_count);
     }
 
-    clEnqueueWriteBuffer(
-        queue, buf_dataset, CL_FALSE,
-        0, sizeof(uchar) * num_filters * filter_size,
-        dataset, 0, NULL, NULL
-    );
+    const int Q = filter_size, R = padd_filters;
+    if (cache->dataset_t) {
+        // already transposed and padded in the cache file
+        clEnqueueWriteBuffer(
+            queue, buf_dataset_t, CL_FALSE,
+            0, sizeof(uchar) * Q * R,
+            cache->dataset_t, 0, NULL, NULL
+        );
+    }
+    else {
+        clEnqueueWriteBuffer(
+            queue, buf_dataset, CL_FALSE,
+            0, sizeof(uchar) * num_filters * filter_size,
+            cache->dataset, 0, NULL, NULL
+        );
 
-    const int Q = filter_size, R = num_filters + 32;
-    size_t gws_trans2[] = {Q, R};
-    size_t lws_trans2[] = {16, 16};
-    err  = clSetKernelArg(kernel_transpose, 0, sizeof(cl_mem), &buf_dataset);
-    err |= clSetKernelArg(kernel_transpose, 1, sizeof(cl_mem), &buf_dataset_t);
-    err |= clSetKernelArg(kernel_transpose, 2, sizeof(int), &R);
-    err |= clSetKernelArg(kernel_transpose, 3, sizeof(int), &Q);
-    CHECK_ERROR(err);
-    err = clEnqueueNDRangeKernel(
-        queue, kernel_transpose, 2, NULL, gws_trans2, lws_trans2, 0, NULL, NULL
+        size_t gws_trans2[] = {Q, R};
+        size_t lws_trans2[] = {16, 16};
+        err  = clSetKernelArg(kernel_transpose, 0, sizeof(cl_mem), &buf_dataset);
+        err |= clSetKernelArg(kernel_transpose, 1, sizeof(cl_mem), &buf_dataset_t);
+        err |= clSetKernelArg(kernel_transpose, 2, sizeof(int), &R);
+        err |= clSetKernelArg(kernel_transpose, 3, sizeof(int), &Q);
+        CHECK_ERROR(err);
+        err = clEnqueueNDRangeKernel(
+            queue, kernel_transpose, 2, NULL, gws_trans2, lws_trans2, 0, NULL, NULL
+        );
+        CHECK_ERROR(err);
+    }
+    clFinish(queue);
+}
+
+/*
+ * upload -> conv -> reduction -> read back of one batch in slot b, without
+ * waiting for any of it; the steps are chained with events across queues
+ * with reduction_final the ntiles results land in idx directly, otherwise
+ * finish_batch() reduces the partial minima on the host; with conv_argmin
+ * the diff matrix is never written, conv itself leaves one partial minimum
+ * per tuning.ts dataset images (see num_partials())
+ */
+static void enqueue_batch(int b, const uchar *img_t, int ntiles, int *idx)
+{
+    const int Q = filter_size, R = padd_filters;
+    const int P = (ntiles + 63) / 64 * 64;
+    const int reduction_count = num_partials();
+    const int wg = tuning.reduce_wg;
+
+    err = clEnqueueWriteBuffer(
+        queue_write, buf_img_t[b], CL_FALSE,
+        0, sizeof(uchar) * ntiles * filter_size,
+        img_t, 0, NULL, &write_event[b]
     );
     CHECK_ERROR(err);
 
-    printf("Number of tiles = %d x %d = %d\n", sheight, swidth, num_tiles);
-    for (int i = 0; i < num_tiles; i += batch_size) {
-        const int ntiles = (i + batch_size < num_tiles) ? batch_size : num_tiles - i;
-        const int P = (ntiles + 63) / 64 * 64;
-
-        printf("Calculate tiles[%d ... %d] (%d, %d / %d)\n",
-            i, i + ntiles, ntiles, i, num_tiles
-        );
-
-        clEnqueueWriteBuffer(
-            queue, buf_img_t, CL_FALSE,
-            0, sizeof(uchar) * ntiles * filter_size,
-            img_t + i * filter_size, 0, NULL, NULL
+    size_t gws_conv[] = {R / tuning.cwpt, P / tuning.rwpt};
+    size_t lws_conv[] = {tuning.ts / tuning.cwpt, tuning.ts / tuning.rwpt};
+    if (kernel_conv_argmin) {
+        err  = clSetKernelArg(kernel_conv_argmin, 0, sizeof(cl_mem), &buf_img_t[b]);
+        err |= clSetKernelArg(kernel_conv_argmin, 1, sizeof(cl_mem), &buf_dataset_t);
+        err |= clSetKernelArg(kernel_conv_argmin, 2, sizeof(cl_mem), &buf_diff_reduced[b]);
+        err |= clSetKernelArg(kernel_conv_argmin, 3, sizeof(cl_mem), &buf_idx_reduced[b]);
+        err |= clSetKernelArg(kernel_conv_argmin, 4, sizeof(int), &P);
+        err |= clSetKernelArg(kernel_conv_argmin, 5, sizeof(int), &Q);
+        err |= clSetKernelArg(kernel_conv_argmin, 6, sizeof(int), &R);
+        err |= clSetKernelArg(kernel_conv_argmin, 7, sizeof(int), &num_filters);
+        CHECK_ERROR(err);
+        err = clEnqueueNDRangeKernel(
+            queue, kernel_conv_argmin, 2, NULL, gws_conv, lws_conv, 1, &write_event[b], NULL
         );
-    
-        size_t gws_conv[] = {R >> 2, P >> 2};
-        size_t lws_conv[] = {16, 16};
-        err  = clSetKernelArg(kernel_conv, 0, sizeof(cl_mem), &buf_img_t);
+        CHECK_ERROR(err);
+    }
+    else {
+        err  = clSetKernelArg(kernel_conv, 0, sizeof(cl_mem), &buf_img_t[b]);
         err |= clSetKernelArg(kernel_conv, 1, sizeof(cl_mem), &buf_dataset_t);
         err |= clSetKernelArg(kernel_conv, 2, sizeof(cl_mem), &buf_diff);
         err |= clSetKernelArg(kernel_conv, 3, sizeof(int), &P);
@@ -119,101 +181,205 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
         err |= clSetKernelArg(kernel_conv, 5, sizeof(int), &R);
         CHECK_ERROR(err);
         err = clEnqueueNDRangeKernel(
-            queue, kernel_conv, 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
+            queue, kernel_conv, 2, NULL, gws_conv, lws_conv, 1, &write_event[b], NULL
         );
         CHECK_ERROR(err);
 
+        // buf_diff is shared by all slots, the in-order compute queue serializes it
         size_t gws_reduce[] = {num_filters, ntiles};
-        size_t lws_reduce[] = {256, 1};
+        size_t lws_reduce[] = {wg, 1};
         set_work_size_rounded(gws_reduce, lws_reduce, 2);
         err  = clSetKernelArg(kernel_reduce, 0, sizeof(cl_mem), &buf_diff);
-        err |= clSetKernelArg(kernel_reduce, 1, sizeof(cl_mem), &buf_diff_reduced);
-        err |= clSetKernelArg(kernel_reduce, 2, sizeof(cl_mem), &buf_idx_reduced);
-        err |= clSetKernelArg(kernel_reduce, 3, sizeof(int) * 256, NULL);
-        err |= clSetKernelArg(kernel_reduce, 4, sizeof(int) * 256, NULL);
-        err |= clSetKernelArg(kernel_reduce, 5, sizeof(int), &num_tiles);
+        err |= clSetKernelArg(kernel_reduce, 1, sizeof(cl_mem), &buf_diff_reduced[b]);
+        err |= clSetKernelArg(kernel_reduce, 2, sizeof(cl_mem), &buf_idx_reduced[b]);
+        err |= clSetKernelArg(kernel_reduce, 3, sizeof(int) * wg, NULL);
+        err |= clSetKernelArg(kernel_reduce, 4, sizeof(int) * wg, NULL);
+        err |= clSetKernelArg(kernel_reduce, 5, sizeof(int), &ntiles);
         err |= clSetKernelArg(kernel_reduce, 6, sizeof(int), &num_filters);
         err |= clSetKernelArg(kernel_reduce, 7, sizeof(int), &R);
         CHECK_ERROR(err);
         err = clEnqueueNDRangeKernel(
-            queue, kernel_reduce, 2, NULL, gws_reduce, lws_reduce, 0, NULL, NULL
+            queue, kernel_reduce, 2, NULL, gws_reduce, lws_reduce, 0, NULL,
+            kernel_reduce_final ? NULL : &kernel_event[b]
         );
         CHECK_ERROR(err);
+    }
 
-        clEnqueueReadBuffer(
-            queue, buf_diff_reduced, CL_FALSE,
-            0, sizeof(int) * ntiles * reduction_count, diff_reduced,
-            0, NULL, NULL
+    if (kernel_reduce_final) {
+        size_t gws_final[] = {wg, ntiles};
+        size_t lws_final[] = {wg, 1};
+        err  = clSetKernelArg(kernel_reduce_final, 0, sizeof(cl_mem), &buf_diff_reduced[b]);
+        err |= clSetKernelArg(kernel_reduce_final, 1, sizeof(cl_mem), &buf_idx_reduced[b]);
+        err |= clSetKernelArg(kernel_reduce_final, 2, sizeof(cl_mem), &buf_idx[b]);
+        err |= clSetKernelArg(kernel_reduce_final, 3, sizeof(int) * wg, NULL);
+        err |= clSetKernelArg(kernel_reduce_final, 4, sizeof(int) * wg, NULL);
+        err |= clSetKernelArg(kernel_reduce_final, 5, sizeof(int), &reduction_count);
+        CHECK_ERROR(err);
+        err = clEnqueueNDRangeKernel(
+            queue, kernel_reduce_final, 2, NULL, gws_final, lws_final, 0, NULL, &kernel_event[b]
         );
-        clEnqueueReadBuffer(
-            queue, buf_idx_reduced, CL_TRUE,
-            0, sizeof(int) * ntiles * reduction_count, idx_reduced,
-            0, NULL, NULL
+        CHECK_ERROR(err);
+
+        err = clEnqueueReadBuffer(
+            queue_read, buf_idx[b], CL_FALSE,
+            0, sizeof(int) * ntiles, idx,
+            1, &kernel_event[b], &read_event[b]
+        );
+        CHECK_ERROR(err);
+    }
+    else {
+        err = clEnqueueReadBuffer(
+            queue_read, buf_diff_reduced[b], CL_FALSE,
+            0, sizeof(int) * ntiles * reduction_count, diff_reduced[b],
+            1, &kernel_event[b], NULL
         );
+        CHECK_ERROR(err);
+        err = clEnqueueReadBuffer(
+            queue_read, buf_idx_reduced[b], CL_FALSE,
+            0, sizeof(int) * ntiles * reduction_count, idx_reduced[b],
+            1, &kernel_event[b], &read_event[b]
+        );
+        CHECK_ERROR(err);
+    }
+    clFlush(queue_write);
+    clFlush(queue);
+    clFlush(queue_read);
+}
+
+/* wait for the batch in slot b and reduce its partial minima into idx */
+static void finish_batch(int b, int ntiles, int *idx)
+{
+    const int reduction_count = num_partials();
+
+    // the read queue is in order, so the idx read also covers the diff read
+    clWaitForEvents(1, &read_event[b]);
+    clReleaseEvent(write_event[b]);
+    clReleaseEvent(kernel_event[b]);
+    clReleaseEvent(read_event[b]);
+    if (kernel_reduce_final) return;
 
-        #pragma omp parallel num_threads(NUM_THREADS)
-        {
-            #pragma omp for schedule(guided)
-            for (int t = 0; t < ntiles; ++t) {
-                int diff = INT_MAX, min_j = -1;
-                for (int j = 0; j < reduction_count; ++j) {
-                    if (diff_reduced[t * reduction_count + j] < diff) {
-                        diff = diff_reduced[t * reduction_count + j];
-                        min_j = idx_reduced[t * reduction_count + j];
+    #pragma omp parallel num_threads(NUM_THREADS)
+    {
+        #pragma omp for schedule(guided)
+        for (int t = 0; t < ntiles; ++t) {
+            int diff = INT_MAX, min_j = -1;
+            for (int j = 0; j < reduction_count; ++j) {
+                if (diff_reduced[b][t * reduction_count + j] < diff) {
+                    diff = diff_reduced[b][t * reduction_count + j];
+                    min_j = idx_reduced[b][t * reduction_count + j];
+                }
+            }
+            idx[t] = min_j;
+        }
+    }
+}
+
+/*
+ * img_t[offset + tile][c][h][w] = img[tile's pixel][c], for every tile of one image
+ */
+static void pack_tiles(const uchar *img, int width, int height, uchar *img_t, int offset)
+{
+    const int swidth = width / T, sheight = height / T;
+    #pragma omp parallel for schedule(guided) collapse(2) num_threads(NUM_THREADS)
+    for (int sh = 0; sh < sheight; ++sh) {
+        for (int sw = 0; sw < swidth; ++sw) {
+            for (int c = 0; c < 3; ++c) {
+                for (int h = 0; h < T; ++h) {
+                    for (int w = 0; w < T; ++w) {
+                        // img_t[sh][sw][c][h][w] = img[sh * T + h][sw * T + w][c]
+                        img_t[(size_t)(offset + sh * swidth + sw) * filter_size + (c * T + h) * T + w] = img[(sh * T + h) * width * 3 + (sw * T + w) * 3 + c];
                     }
                 }
-                idx[i + t] = min_j;
             }
         }
     }
-    
-    release_opencl();
 }
 
-char *get_source_code(const char *file_name, size_t *len)
+void photomosaic_run(unsigned char *img, int width, int height, int *idx)
 {
-    char *source_code;
-    size_t length;
-    FILE *file = fopen(file_name, "r");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
+    photomosaic_run_batch(1, &img, &width, &height, &idx);
+}
+
+void photomosaic_run_batch(int n, unsigned char **imgs, const int *widths, const int *heights, int **idx_out)
+{
+    const int batch_size = BATCH_SIZE;
+
+    int num_tiles = 0;
+    for (int b = 0; b < n; ++b) {
+        num_tiles += (widths[b] / T) * (heights[b] / T);
     }
 
-    fseek(file, 0, SEEK_END);
-    length = (size_t)ftell(file);
-    rewind(file);
+    // tiles of all images back to back, so every BATCH_SIZE-tile pass over
+    // the dataset is full even when the images are small
+    uchar *img_t = (uchar*)malloc(sizeof(uchar) * num_tiles * filter_size);
+    int *idx = (int*)malloc(sizeof(int) * num_tiles);
+    for (int b = 0, offset = 0; b < n; ++b) {
+        pack_tiles(imgs[b], widths[b], heights[b], img_t, offset);
+        offset += (widths[b] / T) * (heights[b] / T);
+    }
+    const int num_match = tile_memo_begin(&memo, img_t, num_tiles);
 
-    source_code = (char*)malloc(length + 1);
-    fread(source_code, length, 1, file);
-    source_code[length] = '\0';
+    /*
+     * batch i uses slot i % NUM_BUFFERS; before a slot is reused its previous
+     * batch is retired on the host, which also guarantees that its upload
+     * buffer and reduced buffers are no longer in use on the device
+     */
+    printf("Number of tiles = %d (%d images, %d to match)\n", num_tiles, n, num_match);
+    const int num_batches = (num_match + batch_size - 1) / batch_size;
+    for (int i = 0; i < num_batches + NUM_BUFFERS; ++i) {
+        if (i >= NUM_BUFFERS) {
+            const int j = i - NUM_BUFFERS;
+            const int ntiles = (j + 1 < num_batches) ? batch_size : num_match - j * batch_size;
+            finish_batch(j % NUM_BUFFERS, ntiles, idx + j * batch_size);
+        }
+        if (i < num_batches) {
+            const int ntiles = (i + 1 < num_batches) ? batch_size : num_match - i * batch_size;
+            printf("Calculate tiles[%d ... %d] (%d, %d / %d)\n",
+                i * batch_size, i * batch_size + ntiles, ntiles, i * batch_size, num_match
+            );
+            enqueue_batch(i % NUM_BUFFERS, img_t + (size_t)i * batch_size * filter_size, ntiles, idx + i * batch_size);
+        }
+    }
+    tile_memo_end(&memo, idx);
 
-    fclose(file);
+    for (int b = 0, offset = 0; b < n; ++b) {
+        const int tiles = (widths[b] / T) * (heights[b] / T);
+        memcpy(idx_out[b], idx + offset, sizeof(int) * tiles);
+        offset += tiles;
+    }
 
-    *len = length;
-    return source_code;
+    free(img_t);
+    free(idx);
 }
 
-uchar *get_binary(const char *file_name, size_t *len)
+void photomosaic_release()
 {
-    uchar *binary;
-    size_t binary_size;
-    FILE *file = fopen(file_name, "rb");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
+    tile_memo_release(&memo);
+    release_opencl();
+    for (int b = 0; b < NUM_BUFFERS; ++b) {
+        free(diff_reduced[b]);
+        free(idx_reduced[b]);
     }
+}
 
-    fseek(file, 0, SEEK_END);
-    binary_size = (size_t)ftell(file);
-    rewind(file);
-
-    binary = (uchar*)malloc(binary_size);
-    fread(binary, binary_size, 1, file);
-    fclose(file);
-
-    *len = binary_size;
-    return binary;
+/*
+ * the kernel called name, or its _vec variant with CONV_VEC if the program
+ * has it; NULL if the program has neither
+ */
+static cl_kernel create_conv_kernel(const char *name)
+{
+    static int warned = 0;
+    cl_int err_create;
+    cl_kernel kernel;
+    if (CONV_VEC) {
+        char vec_name[64];
+        snprintf(vec_name, sizeof(vec_name), "%s_vec", name);
+        kernel = clCreateKernel(program, vec_name, &err_create);
+        if (err_create == CL_SUCCESS) return kernel;
+        if (!warned++) printf("%s not in the kernel program, using %s\n", vec_name, name);
+    }
+    kernel = clCreateKernel(program, name, &err_create);
+    return (err_create == CL_SUCCESS) ? kernel : NULL;
 }
 
 void setup_opencl(int batch_size, int num_filters)
@@ -230,61 +396,65 @@ void setup_opencl(int batch_size, int num_filters)
     printf("CreateContext : %f seconds\n", timer_stop(11));
     timer_start(12);
     queue = clCreateCommandQueue(context, device, 0, NULL);
+    queue_write = clCreateCommandQueue(context, device, 0, NULL);
+    queue_read = clCreateCommandQueue(context, device, 0, NULL);
     printf("CreateCommandQueue : %f seconds\n", timer_stop(12));
 
+    char device_name[256];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    if (tuning_load(&tuning, TUNING_DB_PATH, T, device_name) == 0) {
+        printf("tuning for %s : TS %d, RWPT %d, CWPT %d, reduction %d\n",
+            device_name, tuning.ts, tuning.rwpt, tuning.cwpt, tuning.reduce_wg);
+    }
+
     /* Compile the kernel code */
     timer_start(13);
-    /*
-    size_t source_size;
-    const char *source_code = get_source_code("kernel.cl.c", &source_size);
-    program = clCreateProgramWithSource(
-        context, 1, &source_code, &source_size, NULL);
-    err = clBuildProgram(program, 1, &device, "", NULL, NULL);
-    */
-    size_t binary_size;
-    const uchar *kernel_binary = get_binary("kernel.bin", &binary_size);
-    program = clCreateProgramWithBinary(
-        context, 1, &device, &binary_size, &kernel_binary, NULL, &err);
-    clBuildProgram(program, 1, &device, "", NULL, NULL);
+    char options[256];
+    tuning_build_options(&tuning, options, sizeof(options));
+    program = kernel_cache_build(context, 1, &device, "kernel.cl.c", options);
     printf("BuildProgram : %f seconds\n", timer_stop(13));
-    if (err == CL_BUILD_PROGRAM_FAILURE) {
-        char *log;
-        size_t log_size;
-        clGetProgramBuildInfo(
-            program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        log = (char*)malloc(log_size + 1);
-        clGetProgramBuildInfo(
-            program, device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        log[log_size] = '\0';
-        printf("Compile error:\n%s\n", log);
-        free(log);
-        exit(EXIT_FAILURE);
-    }
     timer_start(14);
-    kernel_conv = clCreateKernel(program, "conv", NULL);
+    kernel_conv = create_conv_kernel("conv");
     kernel_reduce = clCreateKernel(program, "reduction", NULL);
     kernel_transpose = clCreateKernel(program, "transpose", NULL);
+    cl_int err_final;
+    kernel_reduce_final = clCreateKernel(program, "reduction_final", &err_final);
+    if (err_final != CL_SUCCESS) {
+        kernel_reduce_final = NULL;
+        printf("reduction_final not in the kernel program, reducing on the host\n");
+    }
+    kernel_conv_argmin = kernel_reduce_final ? create_conv_kernel("conv_argmin") : NULL;
+    if (kernel_reduce_final && !kernel_conv_argmin)
+        printf("conv_argmin not in the kernel program, using conv + reduction\n");
     printf("CreateKernel : %f seconds\n", timer_stop(14));
  
     /* Create buffer */
     timer_start(15);
-    int filter_size = 3 * 32 * 32;
-    buf_img_t = clCreateBuffer(
-        context, CL_MEM_READ_ONLY, sizeof(uchar) * batch_size * filter_size, NULL, NULL);
+    for (int b = 0; b < NUM_BUFFERS; ++b) {
+        buf_img_t[b] = clCreateBuffer(
+            context, CL_MEM_READ_ONLY, sizeof(uchar) * batch_size * filter_size, NULL, NULL);
+    }
     buf_dataset = clCreateBuffer(
         context, CL_MEM_READ_ONLY, sizeof(uchar) * num_filters * filter_size, NULL, NULL);
     buf_dataset_t = clCreateBuffer(
         context, CL_MEM_READ_ONLY, sizeof(uchar) * filter_size * num_filters, NULL, NULL);
-    buf_diff = clCreateBuffer(
-        context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
-    buf_idx = clCreateBuffer(
-        context, CL_MEM_READ_WRITE, sizeof(int) * batch_size, NULL, NULL);
+    buf_diff = NULL;
+    if (!kernel_conv_argmin) {
+        buf_diff = clCreateBuffer(
+            context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
+    }
+    for (int b = 0; b < NUM_BUFFERS; ++b) {
+        buf_idx[b] = clCreateBuffer(
+            context, CL_MEM_READ_WRITE, sizeof(int) * batch_size, NULL, NULL);
+    }
 
-    int reduction_count = (num_filters + 255) / 256;
-    buf_diff_reduced = clCreateBuffer(
-        context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * reduction_count, NULL, NULL);
-    buf_idx_reduced = clCreateBuffer(
-        context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * reduction_count, NULL, NULL);
+    int reduction_count = num_partials();
+    for (int b = 0; b < NUM_BUFFERS; ++b) {
+        buf_diff_reduced[b] = clCreateBuffer(
+            context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * reduction_count, NULL, NULL);
+        buf_idx_reduced[b] = clCreateBuffer(
+            context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * reduction_count, NULL, NULL);
+    }
 
     printf("CreateBuffer : %f seconds\n\n", timer_stop(15));
 }
@@ -293,16 +463,24 @@ void release_opencl()
 {
     /* Release OpenCL object */
     clReleaseMemObject(buf_dataset);
-    clReleaseMemObject(buf_img_t);
     clReleaseMemObject(buf_dataset_t);
-    clReleaseMemObject(buf_diff);
-    clReleaseMemObject(buf_idx);
+    if (buf_diff) clReleaseMemObject(buf_diff);
+    for (int b = 0; b < NUM_BUFFERS; ++b) {
+        clReleaseMemObject(buf_idx[b]);
+        clReleaseMemObject(buf_img_t[b]);
+        clReleaseMemObject(buf_diff_reduced[b]);
+        clReleaseMemObject(buf_idx_reduced[b]);
+    }
     clReleaseContext(context);
     clReleaseCommandQueue(queue);
+    clReleaseCommandQueue(queue_write);
+    clReleaseCommandQueue(queue_read);
     clReleaseProgram(program);
     clReleaseKernel(kernel_transpose);
     clReleaseKernel(kernel_conv);
     clReleaseKernel(kernel_reduce);
+    if (kernel_reduce_final) clReleaseKernel(kernel_reduce_final);
+    if (kernel_conv_argmin) clReleaseKernel(kernel_conv_argmin);
 }
 
 size_t round_work_size(size_t work_size, size_t group_size)
@@ -0,0 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "server.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_LINE 4096
+
+int serve(const char *path, int (*process)(const char *input, const char *output))
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    // a client that hangs up before the reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    printf("server listening on %s\n", path);
+    fflush(stdout);
+
+    int running = 1, count = 0;
+    while (running) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        FILE *in = fdopen(conn, "r");
+        FILE *out = fdopen(dup(conn), "w");
+        char line[MAX_LINE], input[MAX_LINE], output[MAX_LINE];
+        while (fgets(line, sizeof(line), in)) {
+            if (strncmp(line, "quit", 4) == 0) {
+                running = 0;
+                fprintf(out, "bye\n");
+                break;
+            }
+            if (sscanf(line, "%s %s", input, output) != 2) {
+                fprintf(out, "error usage: [input.bmp] [output.bmp]\n");
+                fflush(out);
+                continue;
+            }
+
+            timer_start(5);
+            int ret = process(input, output);
+            double elapsed = timer_stop(5);
+            fflush(stdout);
+            if (ret == 0) {
+                fprintf(out, "ok %s %f\n", output, elapsed);
+                ++count;
+            }
+            else {
+                fprintf(out, "error %s\n", input);
+            }
+            fflush(out);
+        }
+        fclose(in);
+        fclose(out);
+    }
+
+    printf("server stopped after %d images\n", count);
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * resident server mode
+ *
+ * listens on a UNIX socket at path and, for each line
+ * "[input.bmp] [output.bmp]" received on a connection, calls
+ * process(input, output) and replies "ok" or "error" on the same line;
+ * a "quit" line stops the server
+ *
+ * e.g. printf 'in.bmp out.bmp\n' | nc -U photomosaic.sock
+ */
+int serve(const char *path, int (*process)(const char *input, const char *output));
@@ -0,0 +1,346 @@
+/*
+ * tune [-t tile] [-d dataset.bin]
+ *
+ * sweeps the conv_argmin blocking and the reduction work-group size (see
+ * tuning.h) on the first GPU, timing conv_argmin + reduction_final with
+ * profiling events on a batch of query tiles, and stores the fastest
+ * configuration for this device in TUNING_DB_PATH, where main picks it up
+ *
+ * every configuration must reproduce both the matches and the minimum
+ * differences of the default one
+ */
+#include "dataset_cache.h"
+#include "tuning.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <CL/cl.h>
+
+#define BATCH_SIZE 1024
+#define TUNE_REPS 5
+
+typedef unsigned char uchar;
+#define CHECK_ERROR(err) \
+    if (err != CL_SUCCESS) { \
+        printf("[%s:%d] OpenCL error %d\n", __FILE__, __LINE__, err); \
+        exit(EXIT_FAILURE); \
+    }
+
+/* OpenCL variables */
+cl_platform_id platform;
+cl_device_id device;
+cl_context context;
+cl_command_queue queue;
+cl_mem buf_img_t, buf_dataset_t;
+cl_mem buf_diff_reduced, buf_idx_reduced, buf_idx;
+cl_int err;
+
+size_t max_wg;
+cl_ulong local_mem_size;
+const char *source_code;
+size_t source_size;
+
+/* batch geometry */
+int ntiles, P, Q, R, num_filters;
+int *partials; // [ntiles][R / ts], min_diff partials read back from conv_argmin
+
+static const int ts_list[] = {16, 32, 64};
+static const int wpt_list[] = {1, 2, 4, 8};
+static const int wg_list[] = {64, 128, 256, 512};
+
+char *get_source_code(const char *file_name, size_t *len)
+{
+    char *source_code;
+    size_t length;
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL) {
+        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    fseek(file, 0, SEEK_END);
+    length = (size_t)ftell(file);
+    rewind(file);
+
+    source_code = (char*)malloc(length + 1);
+    fread(source_code, length, 1, file);
+    source_code[length] = '\0';
+
+    fclose(file);
+
+    *len = length;
+    return source_code;
+}
+
+static double event_seconds(cl_event event)
+{
+    cl_ulong start, end;
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    return (end - start) * 1e-9;
+}
+
+/*
+ * mean device time of conv_argmin + reduction_final over TUNE_REPS runs of
+ * the batch, after one warm-up run; -1 if t does not build or does not fit
+ * the device; idx and min_diff receive the matches and their differences
+ */
+static double run(const tuning_t *t, int *idx, int *min_diff)
+{
+    const size_t conv_wg = (size_t)(t->ts / t->cwpt) * (t->ts / t->rwpt);
+    if (conv_wg > max_wg || (size_t)t->reduce_wg > max_wg
+        || sizeof(int) * 2 * t->ts * t->ts > local_mem_size)
+        return -1;
+
+    char options[256];
+    tuning_build_options(t, options, sizeof(options));
+    cl_program program = clCreateProgramWithSource(
+        context, 1, &source_code, &source_size, NULL);
+    if (clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return -1;
+    }
+    cl_kernel kernel_conv_argmin = clCreateKernel(program, "conv_argmin", &err);
+    CHECK_ERROR(err);
+    cl_kernel kernel_reduce_final = clCreateKernel(program, "reduction_final", &err);
+    CHECK_ERROR(err);
+
+    size_t conv_max_wg, final_max_wg;
+    clGetKernelWorkGroupInfo(kernel_conv_argmin, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &conv_max_wg, NULL);
+    clGetKernelWorkGroupInfo(kernel_reduce_final, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &final_max_wg, NULL);
+
+    double elapsed = -1;
+    if (conv_wg <= conv_max_wg && (size_t)t->reduce_wg <= final_max_wg) {
+        const int wg = t->reduce_wg;
+        const int reduction_count = R / t->ts;
+        err  = clSetKernelArg(kernel_conv_argmin, 0, sizeof(cl_mem), &buf_img_t);
+        err |= clSetKernelArg(kernel_conv_argmin, 1, sizeof(cl_mem), &buf_dataset_t);
+        err |= clSetKernelArg(kernel_conv_argmin, 2, sizeof(cl_mem), &buf_diff_reduced);
+        err |= clSetKernelArg(kernel_conv_argmin, 3, sizeof(cl_mem), &buf_idx_reduced);
+        err |= clSetKernelArg(kernel_conv_argmin, 4, sizeof(int), &P);
+        err |= clSetKernelArg(kernel_conv_argmin, 5, sizeof(int), &Q);
+        err |= clSetKernelArg(kernel_conv_argmin, 6, sizeof(int), &R);
+        err |= clSetKernelArg(kernel_conv_argmin, 7, sizeof(int), &num_filters);
+        err |= clSetKernelArg(kernel_reduce_final, 0, sizeof(cl_mem), &buf_diff_reduced);
+        err |= clSetKernelArg(kernel_reduce_final, 1, sizeof(cl_mem), &buf_idx_reduced);
+        err |= clSetKernelArg(kernel_reduce_final, 2, sizeof(cl_mem), &buf_idx);
+        err |= clSetKernelArg(kernel_reduce_final, 3, sizeof(int) * wg, NULL);
+        err |= clSetKernelArg(kernel_reduce_final, 4, sizeof(int) * wg, NULL);
+        err |= clSetKernelArg(kernel_reduce_final, 5, sizeof(int), &reduction_count);
+        CHECK_ERROR(err);
+
+        size_t gws_conv[] = {R / t->cwpt, P / t->rwpt};
+        size_t lws_conv[] = {t->ts / t->cwpt, t->ts / t->rwpt};
+        size_t gws_final[] = {wg, ntiles};
+        size_t lws_final[] = {wg, 1};
+        elapsed = 0;
+        for (int rep = 0; rep <= TUNE_REPS; ++rep) {
+            cl_event conv_event, final_event;
+            err = clEnqueueNDRangeKernel(
+                queue, kernel_conv_argmin, 2, NULL, gws_conv, lws_conv, 0, NULL, &conv_event
+            );
+            CHECK_ERROR(err);
+            err = clEnqueueNDRangeKernel(
+                queue, kernel_reduce_final, 2, NULL, gws_final, lws_final, 0, NULL, &final_event
+            );
+            CHECK_ERROR(err);
+            clFinish(queue);
+            if (rep > 0) elapsed += event_seconds(conv_event) + event_seconds(final_event);
+            clReleaseEvent(conv_event);
+            clReleaseEvent(final_event);
+        }
+        elapsed /= TUNE_REPS;
+
+        clEnqueueReadBuffer(
+            queue, buf_idx, CL_TRUE,
+            0, sizeof(int) * ntiles, idx, 0, NULL, NULL
+        );
+
+        // reduction_final only returns the indices, the differences are
+        // folded here from the partials conv_argmin left
+        clEnqueueReadBuffer(
+            queue, buf_diff_reduced, CL_TRUE,
+            0, sizeof(int) * ntiles * reduction_count, partials, 0, NULL, NULL
+        );
+        for (int i = 0; i < ntiles; ++i) {
+            int best = INT_MAX;
+            for (int j = 0; j < reduction_count; ++j) {
+                if (partials[i * reduction_count + j] < best) best = partials[i * reduction_count + j];
+            }
+            min_diff[i] = best;
+        }
+    }
+
+    clReleaseKernel(kernel_conv_argmin);
+    clReleaseKernel(kernel_reduce_final);
+    clReleaseProgram(program);
+    return elapsed;
+}
+
+/* runs t and keeps it in best if it is correct and faster */
+static void try_config(const tuning_t *t, const int *idx_ref, const int *min_diff_ref, int *idx, int *min_diff,
+    tuning_t *best, double *best_time)
+{
+    double elapsed = run(t, idx, min_diff);
+    printf("TS %2d RWPT %d CWPT %d reduction %3d : ", t->ts, t->rwpt, t->cwpt, t->reduce_wg);
+    if (elapsed < 0) {
+        printf("not supported\n");
+        return;
+    }
+    if (memcmp(idx, idx_ref, sizeof(int) * ntiles) != 0
+        || memcmp(min_diff, min_diff_ref, sizeof(int) * ntiles) != 0) {
+        printf("%f ms, wrong matches\n", elapsed * 1e3);
+        return;
+    }
+    printf("%f ms\n", elapsed * 1e3);
+    if (elapsed < *best_time) {
+        *best = *t;
+        *best_time = elapsed;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int tile = DATASET_DEFAULT_TILE;
+    const char *dataset_path = DATASET_DEFAULT_PATH;
+    while (argc > 2 && (strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "-d") == 0)) {
+        if (argv[1][1] == 't') tile = atoi(argv[2]);
+        else dataset_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 1) {
+        printf("Usage : %s [-t tile] [-d dataset.bin]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    dataset_cache_t cache;
+    char cache_path[4096];
+    dataset_cache_path(cache_path, sizeof(cache_path), dataset_path);
+    if (dataset_cache_open(&cache, cache_path, dataset_path, tile) != 0) {
+        printf("%s not found\n", dataset_path);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * the query tiles are blends of two dataset images far apart, in the
+     * [n][c][h][w] layout of img_t; a tile that is itself in the dataset
+     * would find its exact 0 match even if a blocking corrupted the sums of
+     * every other column, so none of them is
+     */
+    num_filters = cache.num_images;
+    Q = cache.image_size;
+    R = cache.padd_cols;
+    ntiles = num_filters < BATCH_SIZE ? num_filters : BATCH_SIZE;
+    P = (ntiles + 63) / 64 * 64;
+    uchar *img_t = (uchar*)calloc((size_t)P * Q, 1);
+    for (int t = 0; t < ntiles; ++t) {
+        const int a = (int)((long long)t * num_filters / ntiles);
+        const int b = (a + num_filters / 2 + 1) % num_filters;
+        for (int q = 0; q < Q; ++q) {
+            img_t[(size_t)t * Q + q] = (cache.dataset[(size_t)a * Q + q] + cache.dataset[(size_t)b * Q + q] + 1) / 2;
+        }
+    }
+
+    uchar *dataset_t = (uchar*)cache.dataset_t;
+    if (!dataset_t) {
+        dataset_t = (uchar*)calloc((size_t)Q * R, 1);
+        for (int n = 0; n < num_filters; ++n) {
+            for (int q = 0; q < Q; ++q) {
+                dataset_t[(size_t)q * R + n] = cache.dataset[(size_t)n * Q + q];
+            }
+        }
+    }
+
+    /* Get platform, device, context, command_queue */
+    clGetPlatformIDs(1, &platform, NULL);
+    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
+    context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    CHECK_ERROR(err);
+
+    char device_name[256];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_wg, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
+    printf("tuning %s for %d x %d tiles, %d images\n\n", device_name, tile, tile, num_filters);
+
+    source_code = get_source_code("kernel.cl.c", &source_size);
+
+    /* Create buffer, partials sized for the smallest TS */
+    buf_img_t = clCreateBuffer(
+        context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(uchar) * P * Q, img_t, &err);
+    CHECK_ERROR(err);
+    buf_dataset_t = clCreateBuffer(
+        context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(uchar) * Q * R, dataset_t, &err);
+    CHECK_ERROR(err);
+    buf_diff_reduced = clCreateBuffer(
+        context, CL_MEM_READ_WRITE, sizeof(int) * P * (R / ts_list[0]), NULL, NULL);
+    buf_idx_reduced = clCreateBuffer(
+        context, CL_MEM_READ_WRITE, sizeof(int) * P * (R / ts_list[0]), NULL, NULL);
+    buf_idx = clCreateBuffer(
+        context, CL_MEM_READ_WRITE, sizeof(int) * ntiles, NULL, NULL);
+
+    /*
+     * the default is the reference; the blocking is swept with the default
+     * reduction work-group, then the work-group with the best blocking
+     */
+    partials = (int*)malloc(sizeof(int) * ntiles * (R / ts_list[0]));
+    int *idx_ref = (int*)malloc(sizeof(int) * ntiles);
+    int *idx = (int*)malloc(sizeof(int) * ntiles);
+    int *min_diff_ref = (int*)malloc(sizeof(int) * ntiles);
+    int *min_diff = (int*)malloc(sizeof(int) * ntiles);
+    tuning_t best = TUNING_DEFAULT;
+    double best_time = run(&best, idx_ref, min_diff_ref);
+    if (best_time < 0) {
+        printf("the default configuration does not run on %s\n", device_name);
+        exit(EXIT_FAILURE);
+    }
+    printf("default : %f ms\n", best_time * 1e3);
+
+    const int num_ts = sizeof(ts_list) / sizeof(ts_list[0]);
+    const int num_wpt = sizeof(wpt_list) / sizeof(wpt_list[0]);
+    const int num_wg = sizeof(wg_list) / sizeof(wg_list[0]);
+    for (int i = 0; i < num_ts; ++i) {
+        for (int r = 0; r < num_wpt; ++r) {
+            for (int c = 0; c < num_wpt; ++c) {
+                tuning_t t = {ts_list[i], wpt_list[r], wpt_list[c], best.reduce_wg};
+                if (tuning_is_default(&t)) continue;
+                try_config(&t, idx_ref, min_diff_ref, idx, min_diff, &best, &best_time);
+            }
+        }
+    }
+    const tuning_t blocking = best;
+    for (int i = 0; i < num_wg; ++i) {
+        tuning_t t = blocking;
+        t.reduce_wg = wg_list[i];
+        if (t.reduce_wg != blocking.reduce_wg) try_config(&t, idx_ref, min_diff_ref, idx, min_diff, &best, &best_time);
+    }
+
+    printf("\nbest : TS %d RWPT %d CWPT %d reduction %d, %f ms\n",
+        best.ts, best.rwpt, best.cwpt, best.reduce_wg, best_time * 1e3);
+    int ret = tuning_save(&best, TUNING_DB_PATH, tile, device_name);
+    if (ret == 0) printf("saved to %s\n", TUNING_DB_PATH);
+
+    /* Release OpenCL object */
+    clReleaseMemObject(buf_img_t);
+    clReleaseMemObject(buf_dataset_t);
+    clReleaseMemObject(buf_diff_reduced);
+    clReleaseMemObject(buf_idx_reduced);
+    clReleaseMemObject(buf_idx);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+
+    if (dataset_t != cache.dataset_t) free(dataset_t);
+    free(img_t);
+    free(partials);
+    free(idx_ref);
+    free(idx);
+    free(min_diff_ref);
+    free(min_diff);
+    free((char*)source_code);
+    dataset_cache_close(&cache);
+    return ret == 0 ? 0 : EXIT_FAILURE;
+}
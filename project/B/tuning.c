@@ -0,0 +1,92 @@
+#include "tuning.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LINE 1024
+#define MAX_ENTRIES 256
+
+int tuning_is_default(const tuning_t *t)
+{
+    const tuning_t d = TUNING_DEFAULT;
+    return t->ts == d.ts && t->rwpt == d.rwpt && t->cwpt == d.cwpt;
+}
+
+void tuning_build_options(const tuning_t *t, char *options, size_t size)
+{
+    snprintf(options, size, " -D TS=%d -D RWPT=%d -D CWPT=%d", t->ts, t->rwpt, t->cwpt);
+}
+
+/*
+ * one line "tile ts rwpt cwpt reduce_wg device name", the name runs to the
+ * end of the line since device names contain spaces
+ */
+static int parse_line(const char *line, int *tile, tuning_t *t, char *name)
+{
+    int n;
+    if (line[0] == '#' || sscanf(line, "%d %d %d %d %d %n", tile, &t->ts, &t->rwpt, &t->cwpt, &t->reduce_wg, &n) != 5)
+        return -1;
+    strcpy(name, line + n);
+    name[strcspn(name, "\r\n")] = '\0';
+    return 0;
+}
+
+int tuning_load(tuning_t *t, const char *path, int tile, const char *device_name)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    char line[MAX_LINE], name[MAX_LINE];
+    int ret = -1;
+    while (ret != 0 && fgets(line, sizeof(line), file)) {
+        int entry_tile;
+        tuning_t entry;
+        if (parse_line(line, &entry_tile, &entry, name) == 0 && entry_tile == tile && strcmp(name, device_name) == 0) {
+            *t = entry;
+            ret = 0;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+int tuning_save(const tuning_t *t, const char *path, int tile, const char *device_name)
+{
+    // keep every other entry, in order
+    char *lines[MAX_ENTRIES];
+    int count = 0;
+    FILE *file = fopen(path, "r");
+    if (file) {
+        char line[MAX_LINE], name[MAX_LINE];
+        while (count < MAX_ENTRIES && fgets(line, sizeof(line), file)) {
+            int entry_tile;
+            tuning_t entry;
+            if (parse_line(line, &entry_tile, &entry, name) != 0) continue;
+            if (entry_tile == tile && strcmp(name, device_name) == 0) continue;
+            line[strcspn(line, "\r\n")] = '\0';
+            lines[count] = (char*)malloc(strlen(line) + 1);
+            strcpy(lines[count++], line);
+        }
+        fclose(file);
+    }
+
+    int ret = 0;
+    file = fopen(path, "w");
+    if (!file) {
+        printf("cannot write %s\n", path);
+        ret = -1;
+    }
+    else {
+        fprintf(file, "# tile ts rwpt cwpt reduce_wg device\n");
+        for (int i = 0; i < count; ++i) {
+            fprintf(file, "%s\n", lines[i]);
+        }
+        fprintf(file, "%d %d %d %d %d %s\n", tile, t->ts, t->rwpt, t->cwpt, t->reduce_wg, device_name);
+        if (fclose(file) != 0) ret = -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        free(lines[i]);
+    }
+    return ret;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * per-device kernel configuration: the conv / conv_argmin blocking of
+ * kernel.cl.c (TS, RWPT, CWPT) and the work-group size of reduction and
+ * reduction_final
+ *
+ * the tune tool sweeps them on the local device and stores the fastest in
+ * a text database, one line per (tile, device name), which setup_opencl()
+ * looks up on every run and passes to the kernel cache as build options
+ */
+#define TUNING_DB_PATH "tuning.db"
+
+typedef struct {
+    int ts, rwpt, cwpt; // work-group of (ts / cwpt) x (ts / rwpt) threads
+    int reduce_wg;
+} tuning_t;
+
+#define TUNING_DEFAULT {64, 4, 4, 256}
+
+/* 1 if t is the blocking kernel.cl.c defaults to */
+int tuning_is_default(const tuning_t *t);
+
+/* " -D TS=.. -D RWPT=.. -D CWPT=.." for clBuildProgram */
+void tuning_build_options(const tuning_t *t, char *options, size_t size);
+
+/*
+ * the entry for (tile, device_name) of the database at path
+ * returns 0 if found, -1 (t unchanged) otherwise
+ */
+int tuning_load(tuning_t *t, const char *path, int tile, const char *device_name);
+
+/* adds or replaces the entry for (tile, device_name); returns 0 on success */
+int tuning_save(const tuning_t *t, const char *path, int tile, const char *device_name);
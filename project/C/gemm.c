@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <omp.h>
+
+#include "gemm.h"
+
+typedef unsigned char uchar;
+#define NUM_THREADS 32
+#define TSIZE GEMM_TSIZE
+
+void sqnorm_rows(const uchar *a, int rows, int cols, int *norm)
+{
+    #pragma omp parallel for num_threads(NUM_THREADS) schedule(static)
+    for (int i = 0; i < rows; ++i) {
+        int sum = 0;
+        for (int j = 0; j < cols; ++j) {
+            int x = a[(size_t)i * cols + j];
+            sum += x * x;
+        }
+        norm[i] = sum;
+    }
+}
+
+void sqnorm_cols(const uchar *b, int rows, int cols, int *norm)
+{
+    memset(norm, 0, sizeof(int) * cols);
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            int x = b[(size_t)i * cols + j];
+            norm[j] += x * x;
+        }
+    }
+}
+
+/*
+ * csub = a[ii-th row block] * b[jj-th column block], only the cross term a * b
+ */
+static void block_dot(const uchar *a, const uchar *b, int ii, int jj, int Q, int R, int csub[TSIZE][TSIZE])
+{
+    int asub[TSIZE][TSIZE], bsub[TSIZE][TSIZE];
+    const int NUM_TILES = Q / TSIZE;
+
+    // init csub <- 0
+    memset(csub, 0, sizeof(int) * TSIZE * TSIZE);
+
+    for (int t = 0; t < NUM_TILES; ++t) {
+        // load asub, bsub <- a, b
+        for (int i = 0; i < TSIZE; ++i) {
+            const uchar *arow = a + (size_t)(ii * TSIZE + i) * Q + t * TSIZE;
+            const uchar *brow = b + (size_t)(t * TSIZE + i) * R + jj * TSIZE;
+            for (int j = 0; j < TSIZE; ++j) {
+                asub[i][j] = (int)arow[j];
+                bsub[i][j] = (int)brow[j];
+            }
+        }
+        // calculate csub
+        for (int i = 0; i < TSIZE; ++i) {
+            for (int j = 0; j < TSIZE; ++j) {
+                for (int k = 0; k < TSIZE; ++k) {
+                    csub[i][j] += asub[i][k] * bsub[k][j];
+                }
+            }
+        }
+    }
+}
+
+void gemm_u8_argmin(const uchar *a, const uchar *b,
+    const int *norm_a, const int *norm_b, int n, int m,
+    int P, int Q, int R, int *min_diff, int *idx)
+{
+    // split rows of a into S slices so that there are enough work items
+    // even when there are only a few column blocks
+    const int NUM_COL_BLOCKS = R / TSIZE;
+    const int NUM_ROW_BLOCKS = (n + TSIZE - 1) / TSIZE;
+    const int S = (NUM_THREADS + NUM_COL_BLOCKS - 1) / NUM_COL_BLOCKS;
+    int *part_min = (int*)malloc(sizeof(int) * S * R);
+    int *part_idx = (int*)malloc(sizeof(int) * S * R);
+
+    #pragma omp parallel num_threads(NUM_THREADS)
+    {
+        int csub[TSIZE][TSIZE];
+        int lmin[TSIZE], lidx[TSIZE];
+
+        #pragma omp for collapse(2) schedule(static)
+        for (int s = 0; s < S; ++s) {
+            for (int jj = 0; jj < NUM_COL_BLOCKS; ++jj) {
+                for (int j = 0; j < TSIZE; ++j) {
+                    lmin[j] = INT_MAX;
+                    lidx[j] = -1;
+                }
+
+                const int ii_begin = NUM_ROW_BLOCKS * s / S;
+                const int ii_end = NUM_ROW_BLOCKS * (s + 1) / S;
+                for (int ii = ii_begin; ii < ii_end; ++ii) {
+                    block_dot(a, b, ii, jj, Q, R, csub);
+
+                    // fold csub into the running (min, argmin)
+                    for (int i = 0; i < TSIZE; ++i) {
+                        const int li = ii * TSIZE + i;
+                        if (li >= n) break;
+                        for (int j = 0; j < TSIZE; ++j) {
+                            int diff = norm_a[li] + norm_b[jj * TSIZE + j] - 2 * csub[i][j];
+                            if (diff < lmin[j]) {
+                                lmin[j] = diff;
+                                lidx[j] = li;
+                            }
+                        }
+                    }
+                }
+
+                for (int j = 0; j < TSIZE; ++j) {
+                    part_min[s * R + jj * TSIZE + j] = lmin[j];
+                    part_idx[s * R + jj * TSIZE + j] = lidx[j];
+                }
+            }
+        }
+
+        // slices are visited in order, so ties still go to the lowest row
+        #pragma omp for schedule(static)
+        for (int j = 0; j < m; ++j) {
+            int diff = INT_MAX, min_i = -1;
+            for (int s = 0; s < S; ++s) {
+                if (part_min[s * R + j] < diff) {
+                    diff = part_min[s * R + j];
+                    min_i = part_idx[s * R + j];
+                }
+            }
+            min_diff[j] = diff;
+            idx[j] = min_i;
+        }
+    }
+
+    free(part_min);
+    free(part_idx);
+}
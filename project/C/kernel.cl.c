@@ -1,7 +1,19 @@
+/*
+ * conv blocking, overridable with -D (see tuning.h): a work-group of SK x RS
+ * threads computes a TS x TS block of the diff matrix, each thread RWPT rows
+ * RS apart and CWPT columns SK apart; TS must divide 64
+ */
+#ifndef TS
 #define TS 64
+#endif
+#ifndef RWPT
 #define RWPT 4
+#endif
+#ifndef CWPT
 #define CWPT 4
-#define SK 16
+#endif
+#define SK (TS / CWPT)
+#define RS (TS / RWPT)
 #define WIDTH 4
 
 __kernel void transpose(
@@ -12,7 +24,6 @@ __kernel void transpose(
     int i = get_global_id(1);
     int j = get_global_id(0);
     
-    int gi = get_group_id(1), gj = get_group_id(0);
     int li = get_local_id(1), lj = get_local_id(0);
 
     __local uchar X[16][16];
@@ -23,8 +34,9 @@ __kernel void transpose(
     
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    int ni = gj * 16 + li;
-    int nj = gi * 16 + lj;
+    // from the global ids, so that a global offset transposes a band of rows
+    int ni = j - lj + li;
+    int nj = i - li + lj;
     if (ni < Q && nj < P) {
         B[ni * P + nj] = (int)X[lj][li];
     }
@@ -55,7 +67,7 @@ __kernel void conv(
         }
     }
 
-    const int numTiles = COL_A >> 6;
+    const int numTiles = COL_A / TS;
     int t = 0;
     do {
         const int tiledRow = TS * t + row;
@@ -65,7 +77,7 @@ __kernel void conv(
         for (int rw = 0; rw < RWPT; rw++) {
             #pragma unroll
             for (int cw = 0; cw < CWPT; cw++) {
-                int wi = SK * rw, wj = SK * cw;
+                int wi = RS * rw, wj = SK * cw;
                 Asub[row + wi][col + wj] = (int)A[(globalRow + wi) * COL_A + (tiledCol + wj)];
                 Bsub[row + wi][col + wj] = (int)B[(tiledRow + wi) * COL_B + (globalCol + wj)];
             }
@@ -82,7 +94,7 @@ __kernel void conv(
 
             #pragma unroll
             for (int rw = 0; rw < RWPT; rw++) {
-                Areg = Asub[row + SK * rw][k];
+                Areg = Asub[row + RS * rw][k];
                 #pragma unroll
                 for (int cw = 0; cw < CWPT; cw++) {
                     // acc[rw][cw] += (Areg - Breg[cw]) * (Areg - Breg[cw]);
@@ -101,12 +113,263 @@ __kernel void conv(
     for (int rw = 0; rw < RWPT; rw++) {
         #pragma unroll
         for (int cw = 0; cw < CWPT; cw++) {
-            int wi = SK * rw, wj = SK * cw;
+            int wi = RS * rw, wj = SK * cw;
             C[(globalRow + wi) * COL_B + (globalCol + wj)] = acc[rw][cw];
         }
     }
 }
 
+/*
+ * conv fused with the first reduction step: rather than the ROW_A x COL_B diff
+ * matrix, each work-group leaves the (min, idx) of its TS dataset columns for
+ * each of its TS tiles, in min_diff[ROW_A][COL_B / TS] and idx[ROW_A][COL_B / TS]
+ * which reduction_final then folds; columns past num_filters are padding
+ */
+__kernel void conv_argmin(
+    const __global uchar *A,
+    const __global uchar *B,
+    __global int *min_diff,
+    __global int *idx,
+    const int ROW_A, const int COL_A, const int COL_B, const int num_filters)
+{
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    const int globalRow = TS * get_group_id(1) + row;
+    const int globalCol = TS * get_group_id(0) + col;
+
+    __local int Asub[TS][TS];
+    __local int Bsub[TS][TS];
+
+    int Areg, Breg[CWPT];
+    int acc[RWPT][CWPT];
+
+    #pragma unroll
+    for (int rw = 0; rw < RWPT; rw++) {
+        #pragma unroll
+        for (int cw = 0; cw < CWPT; cw++) {
+            acc[rw][cw] = 0;
+        }
+    }
+
+    const int numTiles = COL_A / TS;
+    int t = 0;
+    do {
+        const int tiledRow = TS * t + row;
+        const int tiledCol = TS * t + col;
+
+        #pragma unroll
+        for (int rw = 0; rw < RWPT; rw++) {
+            #pragma unroll
+            for (int cw = 0; cw < CWPT; cw++) {
+                int wi = RS * rw, wj = SK * cw;
+                Asub[row + wi][col + wj] = (int)A[(globalRow + wi) * COL_A + (tiledCol + wj)];
+                Bsub[row + wi][col + wj] = (int)B[(tiledRow + wi) * COL_B + (globalCol + wj)];
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (int k = 0; k < TS; k++) {
+            #pragma unroll
+            for (int cw = 0; cw < CWPT; cw++) {
+                Breg[cw] = Bsub[k][col + SK * cw];
+            }
+
+            #pragma unroll
+            for (int rw = 0; rw < RWPT; rw++) {
+                Areg = Asub[row + RS * rw][k];
+                #pragma unroll
+                for (int cw = 0; cw < CWPT; cw++) {
+                    int x = Areg - Breg[cw];
+                    acc[rw][cw] += mul24(x, x);
+                }
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        t++;
+    } while (t < numTiles);
+
+    // the tiles are no longer needed, Asub / Bsub now hold the (min, idx) of
+    // each thread's CWPT columns, one slot per (tile row, thread column)
+    #pragma unroll
+    for (int rw = 0; rw < RWPT; rw++) {
+        int best = INT_MAX, best_idx = -1;
+        #pragma unroll
+        for (int cw = 0; cw < CWPT; cw++) {
+            int j = globalCol + SK * cw;
+            if (j < num_filters && acc[rw][cw] < best) {
+                best = acc[rw][cw];
+                best_idx = j;
+            }
+        }
+        Asub[row + RS * rw][col] = best;
+        Bsub[row + RS * rw][col] = best_idx;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // SK threads share each tile row; ties go to the lowest idx
+    for (int p = SK / 2; p >= 1; p = p >> 1) {
+        if (col < p) {
+            #pragma unroll
+            for (int rw = 0; rw < RWPT; rw++) {
+                int r = row + RS * rw;
+                int d = Asub[r][col + p], x = Bsub[r][col + p];
+                if (d < Asub[r][col] || (d == Asub[r][col] && x < Bsub[r][col])) {
+                    Asub[r][col] = d;
+                    Bsub[r][col] = x;
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (col == 0) {
+        #pragma unroll
+        for (int rw = 0; rw < RWPT; rw++) {
+            int index = (globalRow + RS * rw) * get_num_groups(0) + get_group_id(0);
+            min_diff[index] = Asub[row + RS * rw][0];
+            idx[index] = Bsub[row + RS * rw][0];
+        }
+    }
+}
+
+/*
+ * conv_vec / conv_argmin_vec : conv and conv_argmin with the same TS x TS
+ * blocking, but the tiles stay packed as uchar in local memory (8 KB instead
+ * of 32 KB) and are moved with one uchar16 per thread and tile; each thread
+ * owns CWPT (= 4) adjacent dataset columns instead of SK-strided ones, so a
+ * row of B is one uchar4 and the squared differences are int4 math; they
+ * exist only with the default blocking
+ */
+#if TS == 64 && RWPT == 4 && CWPT == 4
+void conv_vec_acc(
+    const __global uchar *A,
+    const __global uchar *B,
+    __local uchar *Asub,
+    __local uchar *Bsub,
+    int4 *acc,
+    const int COL_A, const int COL_B)
+{
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    const int lid = row * SK + col;
+    const int lr = lid >> 2, lc = (lid & 3) << 4; // this thread's uchar16 of a TS x TS tile
+
+    const __global uchar *Ablock = A + (TS * get_group_id(1) + lr) * COL_A + lc;
+    const __global uchar *Bblock = B + lr * COL_B + TS * get_group_id(0) + lc;
+
+    #pragma unroll
+    for (int rw = 0; rw < RWPT; rw++) {
+        acc[rw] = (int4)(0);
+    }
+
+    const int numTiles = COL_A / TS;
+    for (int t = 0; t < numTiles; t++) {
+        vstore16(vload16(0, Ablock + TS * t), 0, Asub + lr * TS + lc);
+        vstore16(vload16(0, Bblock + TS * t * COL_B), 0, Bsub + lr * TS + lc);
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll 4
+        for (int k = 0; k < TS; k++) {
+            int4 Breg = convert_int4(vload4(col, Bsub + k * TS));
+            #pragma unroll
+            for (int rw = 0; rw < RWPT; rw++) {
+                int4 x = Breg - (int)Asub[(row + RS * rw) * TS + k];
+                acc[rw] += mul24(x, x);
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+__kernel void conv_vec(
+    const __global uchar *A,
+    const __global uchar *B,
+    __global int *C,
+    const int ROW_A, const int COL_A, const int COL_B)
+{
+    __local uchar Asub[TS * TS];
+    __local uchar Bsub[TS * TS];
+    int4 acc[RWPT];
+
+    conv_vec_acc(A, B, Asub, Bsub, acc, COL_A, COL_B);
+
+    const int globalRow = TS * get_group_id(1) + get_local_id(1);
+    const int globalCol = TS * get_group_id(0) + CWPT * get_local_id(0);
+    #pragma unroll
+    for (int rw = 0; rw < RWPT; rw++) {
+        vstore4(acc[rw], 0, C + (globalRow + RS * rw) * COL_B + globalCol);
+    }
+}
+
+__kernel void conv_argmin_vec(
+    const __global uchar *A,
+    const __global uchar *B,
+    __global int *min_diff,
+    __global int *idx,
+    const int ROW_A, const int COL_A, const int COL_B, const int num_filters)
+{
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+
+    __local uchar Asub[TS * TS];
+    __local uchar Bsub[TS * TS];
+    __local int l_min_diff[TS][SK];
+    __local int l_idx[TS][SK];
+    int4 acc[RWPT];
+
+    conv_vec_acc(A, B, Asub, Bsub, acc, COL_A, COL_B);
+
+    const int globalRow = TS * get_group_id(1) + row;
+    const int globalCol = TS * get_group_id(0) + CWPT * col;
+    #pragma unroll
+    for (int rw = 0; rw < RWPT; rw++) {
+        int d[CWPT] = {acc[rw].x, acc[rw].y, acc[rw].z, acc[rw].w};
+        int best = INT_MAX, best_idx = -1;
+        #pragma unroll
+        for (int cw = 0; cw < CWPT; cw++) {
+            if (globalCol + cw < num_filters && d[cw] < best) {
+                best = d[cw];
+                best_idx = globalCol + cw;
+            }
+        }
+        l_min_diff[row + RS * rw][col] = best;
+        l_idx[row + RS * rw][col] = best_idx;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // same fold as conv_argmin; ties go to the lowest idx
+    for (int p = SK / 2; p >= 1; p = p >> 1) {
+        if (col < p) {
+            #pragma unroll
+            for (int rw = 0; rw < RWPT; rw++) {
+                int r = row + RS * rw;
+                int d = l_min_diff[r][col + p], x = l_idx[r][col + p];
+                if (d < l_min_diff[r][col] || (d == l_min_diff[r][col] && x < l_idx[r][col])) {
+                    l_min_diff[r][col] = d;
+                    l_idx[r][col] = x;
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (col == 0) {
+        #pragma unroll
+        for (int rw = 0; rw < RWPT; rw++) {
+            int index = (globalRow + RS * rw) * get_num_groups(0) + get_group_id(0);
+            min_diff[index] = l_min_diff[row + RS * rw][0];
+            idx[index] = l_idx[row + RS * rw][0];
+        }
+    }
+}
+#endif
+
 __kernel void reduction(
     __global int *diff,
     __global int *min_diff,
@@ -137,3 +400,48 @@ __kernel void reduction(
         idx[index] = l_idx[0];
     }
 }
+
+/*
+ * second-level reduction: one work-group per tile folds the num_partials
+ * (min_diff, idx) pairs left by reduction or conv_argmin into the final idx,
+ * so only one int per tile is read back; ties go to the lowest idx, as on
+ * the host
+ */
+__kernel void reduction_final(
+    __global int *min_diff,
+    __global int *idx,
+    __global int *out_idx,
+    __local int *l_min_diff,
+    __local int *l_idx,
+    const int num_partials)
+{
+    int i = get_global_id(1);
+    int lj = get_local_id(0);
+
+    int best = INT_MAX, best_idx = -1;
+    for (int j = lj; j < num_partials; j += get_local_size(0)) {
+        int d = min_diff[i * num_partials + j];
+        if (d < best) {
+            best = d;
+            best_idx = idx[i * num_partials + j];
+        }
+    }
+    l_min_diff[lj] = best;
+    l_idx[lj] = best_idx;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int p = get_local_size(0) / 2; p >= 1; p = p >> 1) {
+        if (lj < p) {
+            int d = l_min_diff[lj + p], x = l_idx[lj + p];
+            if (d < l_min_diff[lj] || (d == l_min_diff[lj] && x < l_idx[lj])) {
+                l_min_diff[lj] = d;
+                l_idx[lj] = x;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lj == 0) {
+        out_idx[i] = l_idx[0];
+    }
+}
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "kernel_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_DEVICES 16
+#define MAX_PATH 4096
+
+/* whole file in a malloc'ed buffer, NULL if it cannot be read */
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+
+    char *data = length > 0 ? (char*)malloc(length + 1) : NULL;
+    if (data && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (!data) return NULL;
+
+    data[length] = '\0';
+    *size = length;
+    return data;
+}
+
+/* 64-bit FNV-1a */
+static unsigned long long hash_bytes(unsigned long long h, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void cache_path(char *path, cl_device_id device, const char *source, size_t source_size, const char *options)
+{
+    char name[256] = "", version[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(version), version, NULL);
+
+    unsigned long long h = 14695981039346656037ULL;
+    h = hash_bytes(h, name, strlen(name) + 1);
+    h = hash_bytes(h, version, strlen(version) + 1);
+    h = hash_bytes(h, source, source_size);
+    h = hash_bytes(h, options, strlen(options) + 1);
+    snprintf(path, MAX_PATH, "%s/%016llx.bin", KERNEL_CACHE_DIR, h);
+}
+
+/*
+ * writes each device's binary to its path; a temporary file is renamed into
+ * place so that processes sharing the directory never read a partial binary
+ */
+static void store(cl_program program, cl_uint num_devices, char (*paths)[MAX_PATH])
+{
+    size_t sizes[MAX_DEVICES];
+    unsigned char *binaries[MAX_DEVICES];
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * num_devices, sizes, NULL) != CL_SUCCESS)
+        return;
+    for (cl_uint d = 0; d < num_devices; ++d) {
+        binaries[d] = (unsigned char*)malloc(sizes[d] > 0 ? sizes[d] : 1);
+    }
+
+    mkdir(KERNEL_CACHE_DIR, 0755);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * num_devices, binaries, NULL) == CL_SUCCESS) {
+        for (cl_uint d = 0; d < num_devices; ++d) {
+            if (sizes[d] == 0 || (d > 0 && strcmp(paths[d], paths[d - 1]) == 0)) continue;
+
+            char tmp_path[MAX_PATH + 32];
+            snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", paths[d], (long)getpid());
+            FILE *file = fopen(tmp_path, "wb");
+            int ok = file && fwrite(binaries[d], 1, sizes[d], file) == sizes[d];
+            if (file && fclose(file) != 0) ok = 0;
+            if (!ok || rename(tmp_path, paths[d]) != 0) {
+                printf("kernel cache: cannot write %s\n", paths[d]);
+                remove(tmp_path);
+            }
+        }
+    }
+
+    for (cl_uint d = 0; d < num_devices; ++d) {
+        free(binaries[d]);
+    }
+}
+
+cl_program kernel_cache_build(cl_context context, cl_uint num_devices, const cl_device_id *devices,
+    const char *source_path, const char *options)
+{
+    if (!options) options = "";
+    if (num_devices > MAX_DEVICES) {
+        printf("kernel cache: at most %d devices\n", MAX_DEVICES);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t source_size;
+    char *source = read_file(source_path, &source_size);
+    if (!source) {
+        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, source_path);
+        exit(EXIT_FAILURE);
+    }
+
+    char paths[MAX_DEVICES][MAX_PATH];
+    size_t sizes[MAX_DEVICES];
+    unsigned char *binaries[MAX_DEVICES];
+    int hit = 1;
+    for (cl_uint d = 0; d < num_devices; ++d) {
+        cache_path(paths[d], devices[d], source, source_size, options);
+        binaries[d] = (unsigned char*)read_file(paths[d], &sizes[d]);
+        if (!binaries[d]) hit = 0;
+    }
+
+    cl_program program = NULL;
+    cl_int err;
+    if (hit) {
+        program = clCreateProgramWithBinary(
+            context, num_devices, devices, sizes, (const unsigned char**)binaries, NULL, &err);
+        if (err == CL_SUCCESS)
+            err = clBuildProgram(program, num_devices, devices, options, NULL, NULL);
+        if (err != CL_SUCCESS) {
+            // e.g. written by a driver that reports the same version string
+            printf("kernel cache: %s is unusable, rebuilding\n", paths[0]);
+            if (program) clReleaseProgram(program);
+            program = NULL;
+        }
+        else {
+            printf("kernel cache hit : %s\n", paths[0]);
+        }
+    }
+    for (cl_uint d = 0; d < num_devices; ++d) {
+        free(binaries[d]);
+    }
+
+    if (!program) {
+        const char *source_code = source;
+        program = clCreateProgramWithSource(context, 1, &source_code, &source_size, &err);
+        err = clBuildProgram(program, num_devices, devices, options, NULL, NULL);
+        if (err != CL_SUCCESS) {
+            char *log;
+            size_t log_size;
+            clGetProgramBuildInfo(
+                program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+            log = (char*)malloc(log_size + 1);
+            clGetProgramBuildInfo(
+                program, devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+            log[log_size] = '\0';
+            printf("Compile error:\n%s\n", log);
+            free(log);
+            exit(EXIT_FAILURE);
+        }
+        store(program, num_devices, paths);
+        printf("kernel cache miss : built %s into %s\n", source_path, paths[0]);
+    }
+
+    free(source);
+    return program;
+}
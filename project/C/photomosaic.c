@@ -1,5 +1,8 @@
 #include "photomosaic.h"
 #include "timer.h"
+#include "kernel_cache.h"
+#include "gemm.h"
+#include "tile_memo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +15,24 @@
 #define K 4
 #define NUM_THREADS 32
 
+/*
+ * 1 runs conv_vec / conv_argmin_vec, the variants of conv / conv_argmin that
+ * keep tiles packed as uchar and use vector loads and math (-DCONV_VEC=1)
+ */
+#ifndef CONV_VEC
+#define CONV_VEC 0
+#endif
+
+/*
+ * 1 adds a host worker next to the K device threads (-DHYBRID=0 to drop it):
+ * it matches its own batches with gemm_u8_argmin of project/A, sized at
+ * runtime from the tiles per second measured on the CPU and the devices
+ */
+#ifndef HYBRID
+#define HYBRID 1
+#endif
+#define CPU_PROBE_TILES 64 // CPU batch until both rates are known
+
 typedef unsigned char uchar;
 #define CHECK_ERROR(err) \
     if (err != CL_SUCCESS) { \
@@ -26,34 +47,137 @@ cl_context context;
 cl_command_queue queue[K];
 cl_program program;
 
-size_t binaries_size[K];
-const uchar *binaries[K];
 
 cl_kernel kernel_conv[K], kernel_reduce[K];
+cl_kernel kernel_reduce_final[K]; // NULL if the program lacks it
+cl_kernel kernel_conv_argmin[K];  // NULL if the program lacks it, or reduction_final
 cl_kernel kernel_transpose[K];
 
 cl_mem buf_img[K], buf_dataset[K];
 cl_mem buf_img_t[K], buf_dataset_t[K];
-cl_mem buf_diff[K], buf_idx[K];
+cl_mem buf_diff[K], buf_idx[K]; // no buf_diff with conv_argmin
 cl_mem buf_diff_reduced[K], buf_idx_reduced[K];
 cl_int err;
 
 int *diff_reduced[K], *idx_reduced[K];
 
-char *get_source_code(const char *file_name, size_t *len);
-uchar *get_binary(const char *file_name, size_t *len);
-void setup_opencl(int width, int height);
+/*
+ * the kernel called name, or its _vec variant with CONV_VEC if the program
+ * has it; NULL if the program has neither
+ */
+static cl_kernel create_conv_kernel(const char *name)
+{
+    static int warned = 0;
+    cl_int err_create;
+    cl_kernel kernel;
+    if (CONV_VEC) {
+        char vec_name[64];
+        snprintf(vec_name, sizeof(vec_name), "%s_vec", name);
+        kernel = clCreateKernel(program, vec_name, &err_create);
+        if (err_create == CL_SUCCESS) return kernel;
+        if (!warned++) printf("%s not in the kernel program, using %s\n", vec_name, name);
+    }
+    kernel = clCreateKernel(program, name, &err_create);
+    return (err_create == CL_SUCCESS) ? kernel : NULL;
+}
+
+void setup_opencl(int batch_size, int num_filters, int filter_size);
 void release_opencl();
 size_t round_work_size(size_t work_size, size_t group_size);
 void set_work_size_rounded(size_t *work_size, size_t *group_size, int n);
 
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx)
+/*
+ * idx[0 .. ntiles) for the tiles img_t[0 .. ntiles) ([tile][Q]) on the host;
+ * b, norm_b and min_diff are scratch for up to max_tiles tiles
+ */
+static void match_on_cpu(const uchar *img_t, int ntiles, const dataset_cache_t *cache,
+    const int *norm_dataset, uchar *b, int *norm_b, int *min_diff, int *idx)
 {
-    const int swidth = width / 32, sheight = height / 32;
+    const int Q = cache->image_size;
+    const int R = (ntiles + GEMM_TSIZE - 1) / GEMM_TSIZE * GEMM_TSIZE;
+
+    // gemm_u8_argmin takes the tiles as columns, b[q][t] = img_t[t][q]
+    #pragma omp parallel for num_threads(NUM_THREADS) schedule(static)
+    for (int q = 0; q < Q; ++q) {
+        for (int t = 0; t < R; ++t) {
+            b[(size_t)q * R + t] = (t < ntiles) ? img_t[(size_t)t * Q + q] : 0;
+        }
+    }
+    sqnorm_cols(b, Q, R, norm_b);
+    gemm_u8_argmin(cache->dataset, b, norm_dataset, norm_b, cache->num_images, ntiles,
+        cache->padd_rows, Q, R, min_diff, idx);
+}
+
+/*
+ * the host worker: pulls batches from next_tile like a device thread, but
+ * sizes each one so that it takes the CPU about as long as a full batch
+ * takes one device, and never more than its share of the remaining tiles
+ * at the measured rates, so the devices are not left waiting on it at the end
+ *
+ * rate[k] is the tiles per second of worker k's last batch (0 until known),
+ * rate[K] being the CPU's; returns the number of tiles matched
+ */
+static int run_cpu_worker(const uchar *img_t, int num_tiles, int batch_size, const dataset_cache_t *cache,
+    const int *norm_dataset, int *next_tile, double *rate, int *idx)
+{
+    const int Q = cache->image_size;
+    uchar *b = (uchar*)malloc(sizeof(uchar) * Q * batch_size);
+    int *norm_b = (int*)malloc(sizeof(int) * batch_size);
+    int *min_diff = (int*)malloc(sizeof(int) * batch_size);
+    int ntiles_done = 0;
+
+    while (1) {
+        double device_rate = 0;
+        for (int k = 0; k < K; ++k) {
+            double r;
+            #pragma omp atomic read
+            r = rate[k];
+            device_rate += r;
+        }
+        const double cpu_rate = rate[K];
+
+        int i;
+        #pragma omp atomic read
+        i = *next_tile;
+        if (i >= num_tiles) break;
+
+        int ntiles = CPU_PROBE_TILES;
+        if (cpu_rate > 0 && device_rate > 0) {
+            const double share = (double)(num_tiles - i) * cpu_rate / (cpu_rate + device_rate);
+            const double full = (double)batch_size * cpu_rate * K / device_rate;
+            ntiles = (int)(share < full ? share : full);
+            ntiles = ntiles / GEMM_TSIZE * GEMM_TSIZE;
+            if (ntiles > batch_size) ntiles = batch_size;
+            if (ntiles == 0) break; // the devices alone finish sooner
+        }
+
+        #pragma omp atomic capture
+        { i = *next_tile; *next_tile += ntiles; }
+        if (i >= num_tiles) break;
+        if (i + ntiles > num_tiles) ntiles = num_tiles - i;
+
+        const double start = omp_get_wtime();
+        match_on_cpu(img_t + (size_t)i * Q, ntiles, cache, norm_dataset, b, norm_b, min_diff, idx + i);
+        const double elapsed = omp_get_wtime() - start;
+        #pragma omp atomic write
+        rate[K] = ntiles / elapsed;
+        ntiles_done += ntiles;
+    }
+
+    free(b);
+    free(norm_b);
+    free(min_diff);
+    return ntiles_done;
+}
+
+void photomosaic(unsigned char *img, int width, int height, const dataset_cache_t *cache, int *idx)
+{
+    const int T = cache->tile;
+    const int swidth = width / T, sheight = height / T;
     const int batch_size = BATCH_SIZE;
     const int num_tiles = sheight * swidth;
-    const int filter_size = 3 * 32 * 32;
-    const int num_filters = 60000;
+    const int filter_size = cache->image_size;
+    const int num_filters = cache->num_images;
     const int reduction_count = (num_filters + 255) / 256;
     for (int k = 0; k < K; ++k) {
         diff_reduced[k] = (int*)malloc(sizeof(int) * batch_size * reduction_count);
@@ -61,7 +185,7 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
     }
 
     timer_start(1);
-    setup_opencl(batch_size, num_filters + 32);
+    setup_opencl(batch_size, cache->padd_cols, filter_size);
     printf("setup opencl : %f seconds\n\n", timer_stop(1));
 
     uchar *img_t = (uchar*)malloc(sizeof(uchar) * num_tiles * filter_size);
@@ -71,10 +195,10 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
         for (int sh = 0; sh < sheight; ++sh) {
             for (int sw = 0; sw < swidth; ++sw) {
                 for (int c = 0; c < 3; ++c) {
-                    for (int h = 0; h < 32; ++h) {
-                        for (int w = 0; w < 32; ++w) {
-                            // img_t[sh][sw][c][h][w] = img[sh * 32 + h][sw * 32 + w][c]
-                            img_t[(sh * swidth + sw) * filter_size + (c * 32 + h) * 32 + w] = img[(sh * 32 + h) * width * 3 + (sw * 32 + w) * 3 + c];
+                    for (int h = 0; h < T; ++h) {
+                        for (int w = 0; w < T; ++w) {
+                            // img_t[sh][sw][c][h][w] = img[sh * T + h][sw * T + w][c]
+                            img_t[(size_t)(sh * swidth + sw) * filter_size + (c * T + h) * T + w] = img[(sh * T + h) * width * 3 + (sw * T + w) * 3 + c];
                         }
                     }
                 }
@@ -82,16 +206,30 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
         }
     }
 
+    tile_memo_t memo;
+    tile_memo_init(&memo, cache, 0);
+    const int num_match = tile_memo_begin(&memo, img_t, num_tiles);
+
+    const int Q = filter_size, R = cache->padd_cols;
+    // conv_argmin leaves one partial minimum per 64 dataset images, reduction one per 256
+    const int num_partials = kernel_conv_argmin[0] ? R / 64 : reduction_count;
     for (int k = 0; k < K; ++k) {
+        if (cache->dataset_t) {
+            // already transposed and padded in the cache file
+            clEnqueueWriteBuffer(
+                queue[k], buf_dataset_t[k], CL_FALSE,
+                0, sizeof(uchar) * Q * R,
+                cache->dataset_t, 0, NULL, NULL
+            );
+            continue;
+        }
+
         clEnqueueWriteBuffer(
             queue[k], buf_dataset[k], CL_FALSE,
             0, sizeof(uchar) * num_filters * filter_size,
-            dataset, 0, NULL, NULL
+            cache->dataset, 0, NULL, NULL
         );
-    }
 
-    const int Q = filter_size, R = num_filters + 32;
-    for (int k = 0; k < K; ++k) {
         size_t gws_trans2[] = {Q, R};
         size_t lws_trans2[] = {16, 16};
         err  = clSetKernelArg(kernel_transpose[k], 0, sizeof(cl_mem), &buf_dataset[k]);
@@ -105,79 +243,130 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
         CHECK_ERROR(err);
     }
 
-    printf("Number of tiles = %d x %d = %d\n", sheight, swidth, num_tiles);
-    for (int i = 0; i < num_tiles; i += K * batch_size) {
-        const int ntiles = (i + K * batch_size < num_tiles) ? K * batch_size : num_tiles - i;
-        printf("Calculate tiles[%d ... %d] (%d, %d / %d)\n",
-            i, i + ntiles, ntiles, i, num_tiles
-        );
+    const int *norm_dataset = cache->norm;
+    int *norm_buf = NULL;
+    if (HYBRID && !norm_dataset) {
+        norm_buf = (int*)malloc(sizeof(int) * cache->padd_rows);
+        sqnorm_rows(cache->dataset, cache->padd_rows, filter_size, norm_buf);
+        norm_dataset = norm_buf;
+    }
 
-        int ntiles_per_device[K], ntiles_offset[K];
-        for (int k = 0; k < K; ++k) {
-            ntiles_per_device[k] = ntiles / K;
-            if (k < ntiles % K) ++ntiles_per_device[k];
-            ntiles_offset[k] = (k > 0) ? (ntiles_offset[k - 1] + ntiles_per_device[k - 1]) : 0;
+    /*
+     * one host thread per device pulls the next batch from a shared counter
+     * as soon as its previous batch is done, so a slow or busy device no
+     * longer holds the others back at the end of every round; with HYBRID,
+     * thread K runs the CPU worker, whose gemm opens a nested team
+     */
+    printf("Number of tiles = %d x %d = %d (%d to match)\n", sheight, swidth, num_tiles, num_match);
+    int next_tile = 0;
+    int ntiles_done[K + 1] = {0};
+    double rate[K + 1] = {0};
+    if (HYBRID) omp_set_max_active_levels(2);
+    #pragma omp parallel num_threads(K + HYBRID)
+    {
+        const int k = omp_get_thread_num();
+        cl_int err; // the global one would be shared between device threads
+        if (k == K) {
+            ntiles_done[K] = run_cpu_worker(
+                img_t, num_match, batch_size, cache, norm_dataset, &next_tile, rate, idx);
         }
+        while (k < K) {
+            int i;
+            #pragma omp atomic capture
+            { i = next_tile; next_tile += batch_size; }
+            if (i >= num_match) break;
 
-        for (int k = 0; k < K; ++k) {
-            if (ntiles_per_device[k] == 0) continue;
-            const int P = (ntiles_per_device[k] + 63) / 64 * 64;
+            const int ntiles = (i + batch_size < num_match) ? batch_size : num_match - i;
+            const int P = (ntiles + 63) / 64 * 64;
+            const double start = omp_get_wtime();
 
             clEnqueueWriteBuffer(
                 queue[k], buf_img_t[k], CL_FALSE,
-                0, sizeof(uchar) * ntiles_per_device[k] * filter_size,
-                img_t + (i + ntiles_offset[k]) * filter_size, 0, NULL, NULL
+                0, sizeof(uchar) * ntiles * filter_size,
+                img_t + (size_t)i * filter_size, 0, NULL, NULL
             );
-        
+
             size_t gws_conv[] = {R >> 2, P >> 2};
             size_t lws_conv[] = {16, 16};
-            err  = clSetKernelArg(kernel_conv[k], 0, sizeof(cl_mem), &buf_img_t[k]);
-            err |= clSetKernelArg(kernel_conv[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
-            err |= clSetKernelArg(kernel_conv[k], 2, sizeof(cl_mem), &buf_diff[k]);
-            err |= clSetKernelArg(kernel_conv[k], 3, sizeof(int), &P);
-            err |= clSetKernelArg(kernel_conv[k], 4, sizeof(int), &Q);
-            err |= clSetKernelArg(kernel_conv[k], 5, sizeof(int), &R);
-            CHECK_ERROR(err);
-            err = clEnqueueNDRangeKernel(
-                queue[k], kernel_conv[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
-            );
-            CHECK_ERROR(err);
-
-            size_t gws_reduce[] = {num_filters, ntiles_per_device[k]};
-            size_t lws_reduce[] = {256, 1};
-            set_work_size_rounded(gws_reduce, lws_reduce, 2);
-            err  = clSetKernelArg(kernel_reduce[k], 0, sizeof(cl_mem), &buf_diff[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 1, sizeof(cl_mem), &buf_diff_reduced[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 2, sizeof(cl_mem), &buf_idx_reduced[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 3, sizeof(int) * 256, NULL);
-            err |= clSetKernelArg(kernel_reduce[k], 4, sizeof(int) * 256, NULL);
-            err |= clSetKernelArg(kernel_reduce[k], 5, sizeof(int), &ntiles_per_device[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 6, sizeof(int), &num_filters);
-            err |= clSetKernelArg(kernel_reduce[k], 7, sizeof(int), &R);
-            CHECK_ERROR(err);
-            err = clEnqueueNDRangeKernel(
-                queue[k], kernel_reduce[k], 2, NULL, gws_reduce, lws_reduce, 0, NULL, NULL
-            );
-            CHECK_ERROR(err);
-
-            clEnqueueReadBuffer(
-                queue[k], buf_diff_reduced[k], CL_FALSE,
-                0, sizeof(int) * ntiles_per_device[k] * reduction_count,
-                diff_reduced[k], 0, NULL, NULL
-            );
-            clEnqueueReadBuffer(
-                queue[k], buf_idx_reduced[k], CL_FALSE,
-                0, sizeof(int) * ntiles_per_device[k] * reduction_count,
-                idx_reduced[k], 0, NULL, NULL
-            );
-        }
+            if (kernel_conv_argmin[k]) {
+                err  = clSetKernelArg(kernel_conv_argmin[k], 0, sizeof(cl_mem), &buf_img_t[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 2, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 3, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 4, sizeof(int), &P);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 5, sizeof(int), &Q);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 6, sizeof(int), &R);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 7, sizeof(int), &num_filters);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_conv_argmin[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+            }
+            else {
+                err  = clSetKernelArg(kernel_conv[k], 0, sizeof(cl_mem), &buf_img_t[k]);
+                err |= clSetKernelArg(kernel_conv[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
+                err |= clSetKernelArg(kernel_conv[k], 2, sizeof(cl_mem), &buf_diff[k]);
+                err |= clSetKernelArg(kernel_conv[k], 3, sizeof(int), &P);
+                err |= clSetKernelArg(kernel_conv[k], 4, sizeof(int), &Q);
+                err |= clSetKernelArg(kernel_conv[k], 5, sizeof(int), &R);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_conv[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+
+                size_t gws_reduce[] = {num_filters, ntiles};
+                size_t lws_reduce[] = {256, 1};
+                set_work_size_rounded(gws_reduce, lws_reduce, 2);
+                err  = clSetKernelArg(kernel_reduce[k], 0, sizeof(cl_mem), &buf_diff[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 1, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 2, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 3, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce[k], 4, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce[k], 5, sizeof(int), &ntiles);
+                err |= clSetKernelArg(kernel_reduce[k], 6, sizeof(int), &num_filters);
+                err |= clSetKernelArg(kernel_reduce[k], 7, sizeof(int), &R);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_reduce[k], 2, NULL, gws_reduce, lws_reduce, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+            }
 
-        for (int k = 0; k < K; ++k) {
-            clFinish(queue[k]);
-            #pragma omp parallel num_threads(NUM_THREADS)
-            {
-                #pragma omp for schedule(guided)
-                for (int t = 0; t < ntiles_per_device[k]; ++t) {
+            if (kernel_reduce_final[k]) {
+                // second-level reduction on the device, only ntiles ints come back
+                size_t gws_final[] = {256, ntiles};
+                size_t lws_final[] = {256, 1};
+                err  = clSetKernelArg(kernel_reduce_final[k], 0, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 1, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 2, sizeof(cl_mem), &buf_idx[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 3, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce_final[k], 4, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce_final[k], 5, sizeof(int), &num_partials);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_reduce_final[k], 2, NULL, gws_final, lws_final, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+                clEnqueueReadBuffer(
+                    queue[k], buf_idx[k], CL_TRUE,
+                    0, sizeof(int) * ntiles, idx + i, 0, NULL, NULL
+                );
+            }
+            else {
+                clEnqueueReadBuffer(
+                    queue[k], buf_diff_reduced[k], CL_FALSE,
+                    0, sizeof(int) * ntiles * reduction_count,
+                    diff_reduced[k], 0, NULL, NULL
+                );
+                clEnqueueReadBuffer(
+                    queue[k], buf_idx_reduced[k], CL_TRUE,
+                    0, sizeof(int) * ntiles * reduction_count,
+                    idx_reduced[k], 0, NULL, NULL
+                );
+
+                for (int t = 0; t < ntiles; ++t) {
                     int diff = INT_MAX, min_j = -1;
                     for (int j = 0; j < reduction_count; ++j) {
                         if (diff_reduced[k][t * reduction_count + j] < diff) {
@@ -185,63 +374,28 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
                             min_j = idx_reduced[k][t * reduction_count + j];
                         }
                     }
-                    idx[i + ntiles_offset[k] + t] = min_j;
+                    idx[i + t] = min_j;
                 }
             }
+            ntiles_done[k] += ntiles;
+            const double elapsed = omp_get_wtime() - start;
+            #pragma omp atomic write
+            rate[k] = ntiles / elapsed;
         }
     }
+    tile_memo_end(&memo, idx);
+    tile_memo_release(&memo);
 
+    for (int k = 0; k < K; ++k) {
+        printf(" - device %d : %d tiles\n", k, ntiles_done[k]);
+    }
+    if (HYBRID) printf(" - cpu : %d tiles\n", ntiles_done[K]);
+    free(norm_buf);
     printf("\n");
     release_opencl();
 }
 
-char *get_source_code(const char *file_name, size_t *len)
-{
-    char *source_code;
-    size_t length;
-    FILE *file = fopen(file_name, "r");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
-    }
-
-    fseek(file, 0, SEEK_END);
-    length = (size_t)ftell(file);
-    rewind(file);
-
-    source_code = (char*)malloc(length + 1);
-    fread(source_code, length, 1, file);
-    source_code[length] = '\0';
-
-    fclose(file);
-
-    *len = length;
-    return source_code;
-}
-
-uchar *get_binary(const char *file_name, size_t *len)
-{
-    uchar *binary;
-    size_t binary_size;
-    FILE *file = fopen(file_name, "rb");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
-    }
-
-    fseek(file, 0, SEEK_END);
-    binary_size = (size_t)ftell(file);
-    rewind(file);
-
-    binary = (uchar*)malloc(binary_size);
-    fread(binary, binary_size, 1, file);
-    fclose(file);
-
-    *len = binary_size;
-    return binary;
-}
-
-void setup_opencl(int batch_size, int num_filters)
+void setup_opencl(int batch_size, int num_filters, int filter_size)
 {
     /* Get platform, device, context, command_queue */
     timer_start(9);
@@ -260,48 +414,27 @@ void setup_opencl(int batch_size, int num_filters)
 
     /* Compile the kernel code */
     timer_start(13);
-    /*
-    size_t source_size;
-    const char *source_code = get_source_code("kernel.cl.c", &source_size);
-    program = clCreateProgramWithSource(
-        context, 1, &source_code, &source_size, NULL);
-    err = clBuildProgram(program, K, device, "", NULL, NULL);
-    */
-    size_t binary_size;
-    uchar *kernel_binary = get_binary("kernel.bin", &binary_size);
-    for (int k = 0; k < K; ++k) {
-        binaries_size[k] = binary_size;
-        binaries[k] = kernel_binary;
-    }
-    program = clCreateProgramWithBinary(
-        context, K, device, binaries_size, binaries, NULL, &err);
-    err = clBuildProgram(program, K, device, "", NULL, NULL);
+    program = kernel_cache_build(context, K, device, "kernel.cl.c", "");
     printf("BuildProgram : %f seconds\n", timer_stop(13));
-    if (err == CL_BUILD_PROGRAM_FAILURE) {
-        char *log;
-        size_t log_size;
-        clGetProgramBuildInfo(
-            program, device[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        log = (char*)malloc(log_size + 1);
-        clGetProgramBuildInfo(
-            program, device[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        log[log_size] = '\0';
-        printf("Compile error:\n%s\n", log);
-        free(log);
-        exit(EXIT_FAILURE);
-    }
     timer_start(14);
     for (int i = 0; i < K; ++i) {
-        kernel_conv[i] = clCreateKernel(program, "conv", NULL);
+        kernel_conv[i] = create_conv_kernel("conv");
         kernel_reduce[i] = clCreateKernel(program, "reduction", NULL);
         kernel_transpose[i] = clCreateKernel(program, "transpose", NULL);
+        cl_int err_final;
+        kernel_reduce_final[i] = clCreateKernel(program, "reduction_final", &err_final);
+        if (err_final != CL_SUCCESS) kernel_reduce_final[i] = NULL;
+        kernel_conv_argmin[i] = kernel_reduce_final[i] ? create_conv_kernel("conv_argmin") : NULL;
     }
+    if (!kernel_reduce_final[0])
+        printf("reduction_final not in the kernel program, reducing on the host\n");
+    else if (!kernel_conv_argmin[0])
+        printf("conv_argmin not in the kernel program, using conv + reduction\n");
     printf("CreateKernel : %f seconds\n", timer_stop(14));
  
     /* Create buffer */
     timer_start(15);
-    int filter_size = 3 * 32 * 32;
-    int reduction_count = (num_filters + 255) / 256;
+    int reduction_count = kernel_conv_argmin[0] ? num_filters / 64 : (num_filters + 255) / 256;
     for (int i = 0; i < K; ++i) {
         buf_img_t[i] = clCreateBuffer(
             context, CL_MEM_READ_ONLY, sizeof(uchar) * batch_size * filter_size, NULL, NULL);
@@ -309,8 +442,11 @@ void setup_opencl(int batch_size, int num_filters)
             context, CL_MEM_READ_ONLY, sizeof(uchar) * num_filters * filter_size, NULL, NULL);
         buf_dataset_t[i] = clCreateBuffer(
             context, CL_MEM_READ_ONLY, sizeof(uchar) * filter_size * num_filters, NULL, NULL);
-        buf_diff[i] = clCreateBuffer(
-            context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
+        buf_diff[i] = NULL;
+        if (!kernel_conv_argmin[i]) {
+            buf_diff[i] = clCreateBuffer(
+                context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
+        }
         buf_idx[i] = clCreateBuffer(
             context, CL_MEM_READ_WRITE, sizeof(int) * batch_size, NULL, NULL);
         buf_diff_reduced[i] = clCreateBuffer(
@@ -328,12 +464,14 @@ void release_opencl()
         clReleaseMemObject(buf_dataset[i]);
         clReleaseMemObject(buf_img_t[i]);
         clReleaseMemObject(buf_dataset_t[i]);
-        clReleaseMemObject(buf_diff[i]);
+        if (buf_diff[i]) clReleaseMemObject(buf_diff[i]);
         clReleaseMemObject(buf_idx[i]);
         clReleaseCommandQueue(queue[i]);
         clReleaseKernel(kernel_transpose[i]);
         clReleaseKernel(kernel_conv[i]);
         clReleaseKernel(kernel_reduce[i]);
+        if (kernel_reduce_final[i]) clReleaseKernel(kernel_reduce_final[i]);
+        if (kernel_conv_argmin[i]) clReleaseKernel(kernel_conv_argmin[i]);
     }
     clReleaseContext(context);
     clReleaseProgram(program);
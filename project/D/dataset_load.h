@@ -0,0 +1,58 @@
+#pragma once
+
+#include "dataset_cache.h"
+
+/*
+ * how the ranks get the tile library, picked with -l and timed by main():
+ *
+ * read  : every rank opens it on its own (maps the cache file, or reads raw)
+ * bcast : rank 0 opens it and broadcasts the dataset to a private copy
+ *         on every other rank
+ * node  : one rank per node reads the raw dataset into an MPI shared-memory
+ *         window the other ranks of the node point into; a valid cache file
+ *         is mapped by every rank instead, its pages are shared already
+ * hier  : rank 0 opens it and broadcasts the dataset to one window per node,
+ *         so the file is read once for the whole job
+ * stream: bcast that returns as soon as the broadcasts are posted; the
+ *         dataset arrives in pieces of DATASET_BCAST_CHUNK while the caller
+ *         sets up its devices, and dataset_load_piece() waits for each
+ *
+ * with bcast, hier and stream, ranks other than 0 get the dataset only,
+ * and the optional sections of the cache file stay NULL there
+ */
+enum {
+    DATASET_LOAD_READ,
+    DATASET_LOAD_BCAST,
+    DATASET_LOAD_NODE,
+    DATASET_LOAD_HIER,
+    DATASET_LOAD_STREAM,
+    DATASET_NUM_LOADS
+};
+#define DATASET_LOAD_DEFAULT DATASET_LOAD_NODE
+#define DATASET_BCAST_CHUNK (16 << 20) // bytes per MPI_Bcast, keeps counts within an int
+
+/* the strategy called name, -1 if there is none */
+int dataset_load_parse(const char *name);
+const char *dataset_load_name(int load);
+
+/*
+ * dataset_cache_open() for all ranks with the given strategy
+ *
+ * collective over MPI_COMM_WORLD; returns 0 on success, -1 on every rank if
+ * the dataset cannot be loaded
+ */
+int dataset_load_open(dataset_cache_t *cache, const char *cache_path, const char *raw_path, int tile, int load);
+
+/*
+ * the dataset rows arrive in dataset_load_num_pieces() pieces of a multiple
+ * of 64 rows, one piece of all padd_rows rows unless streamed;
+ * dataset_load_piece() waits for piece i and gives its rows [*begin, *end)
+ */
+int dataset_load_num_pieces(void);
+void dataset_load_piece(int i, int *begin, int *end);
+
+/* seconds dataset_load_piece() spent waiting for pieces, 0 unless streamed */
+double dataset_load_wait_seconds(void);
+
+/* collective, before MPI_Finalize */
+void dataset_load_close(dataset_cache_t *cache);
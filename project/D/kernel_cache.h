@@ -0,0 +1,19 @@
+#pragma once
+
+#include <CL/cl.h>
+
+/*
+ * OpenCL program cache replacing the prebuilt kernel.bin: a program is
+ * looked up in KERNEL_CACHE_DIR under a hash of (device name, driver
+ * version, kernel source, build options) of each device, loaded from its
+ * binaries on a hit, and built from source and stored on a miss, so the
+ * kernels always match kernel.cl.c without running trunk/opencl_make_binary
+ */
+#define KERNEL_CACHE_DIR "kernel_cache"
+
+/*
+ * program for devices[0 .. num_devices) from the source file at source_path;
+ * exits with the build log if the source does not build
+ */
+cl_program kernel_cache_build(cl_context context, cl_uint num_devices, const cl_device_id *devices,
+    const char *source_path, const char *options);
@@ -1,28 +1,74 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <mpi.h>
 
 #include "photomosaic.h"
+#include "dataset_load.h"
 #include "timer.h"
 #include "qdbmp.h"
 
 int main(int argc, char **argv) {
-    MPI_Init(NULL, NULL);
+    // rank 0 of the dynamic mode calls MPI from its main thread only; with a
+    // lower provided level, photomosaic() falls back to the static split
+    int provided;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
     
     int rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     
-    if (argc != 3) {
+    /*
+     * options : -t tile size, -d tile library (its cache file is looked up next to it),
+     *           -l how the ranks load it, see dataset_load.h
+     */
+    int T = DATASET_DEFAULT_TILE;
+    const char *dataset_path = DATASET_DEFAULT_PATH;
+    int load = DATASET_LOAD_DEFAULT;
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-t") == 0) T = atoi(argv[2]);
+        else if (strcmp(argv[1], "-d") == 0) dataset_path = argv[2];
+        else if (strcmp(argv[1], "-l") == 0) load = dataset_load_parse(argv[2]);
+        else break;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3 || load < 0) {
         if (rank == 0)   
-            printf("Usage : %s [input.bmp] [output.bmp]\n", argv[0]);
+            printf("Usage : %s [-t tile] [-d dataset.bin] [-l read|bcast|node|hier|stream] [input.bmp] [output.bmp]\n", argv[0]);
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * read the tile library first: with -l stream its broadcasts are in
+     * flight while rank 0 reads the input image below
+     */
+    dataset_cache_t cache;
+    char cache_path[4096];
+    dataset_cache_path(cache_path, sizeof(cache_path), dataset_path);
+    timer_start(2);
+    int load_failed = dataset_load_open(&cache, cache_path, dataset_path, T, load) != 0;
+    double load_time = timer_stop(2), max_load_time;
+    MPI_Reduce(&load_time, &max_load_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (load_failed) {
+        if (rank == 0)
+            printf("%s not found\n", dataset_path);
         MPI_Finalize();
         exit(EXIT_FAILURE);
     }
+    const unsigned char *dataset = cache.dataset;
+
+    if (rank == 0)
+        printf("dataset read success; %d images of %d x %d%s\n", cache.num_images, T, T, cache.map ? " (mapped cache)" : "");
+    if (rank == 0 && load == DATASET_LOAD_STREAM)
+        printf("dataset load (stream) : %f seconds to post the broadcasts on the slowest rank\n", max_load_time);
+    else if (rank == 0)
+        printf("dataset load (%s) : %f seconds on the slowest rank\n", dataset_load_name(load), max_load_time);
 
     /*
      * read input image
      */
-    BMP *bmp;
+    BMP *bmp = NULL;
     int width = 0, height = 0, depth = 0;
     if (rank == 0) {
         bmp = BMP_ReadFile(argv[1]);
@@ -34,8 +80,8 @@ int main(int argc, char **argv) {
             height = BMP_GetHeight(bmp);
             depth = BMP_GetDepth(bmp);
             printf("image read success; image = %s, width = %d, height = %d, depth = %d\n", argv[1], width, height, depth);
-            if (width % 32 != 0 || height % 32 != 0) {
-                printf("width and height should be multiple of 32.\n");
+            if (width % T != 0 || height % T != 0) {
+                printf("width and height should be multiple of %d.\n", T);
             }
             if (depth != 24) {
                 printf("depth should be 24.\n");
@@ -46,7 +92,8 @@ int main(int argc, char **argv) {
     int info[3] = {width, height, depth};
     MPI_Bcast(info, 3, MPI_INT, 0, MPI_COMM_WORLD);
     width = info[0], height = info[1], depth = info[2];
-    if (width % 32 != 0 || height % 32 != 0 || depth != 24) {
+    if (T <= 0 || width % T != 0 || height % T != 0 || depth != 24) {
+        dataset_load_close(&cache);
         MPI_Finalize();
         exit(EXIT_FAILURE);
     }
@@ -63,35 +110,27 @@ int main(int argc, char **argv) {
         BMP_Free(bmp);
     }
 
-    /*
-     * read cifar-10 dataset
-     */
-    unsigned char *dataset = (unsigned char*)malloc(60000 * 3 * 32 * 32);
-    FILE *fin = fopen("data/cifar-10.bin", "rb");
-    if (!fin) {
-        if (rank == 0)
-            printf("cifar-10.bin not found\n");
-        MPI_Finalize();
-        exit(EXIT_FAILURE);
-    }
-    fread(dataset, 1, 60000 * 3 * 32 * 32, fin);
-    fclose(fin);
-
-    if (rank == 0)
-        printf("dataset read success\n");
-
     /*
      * photomosaic computation
      */
 
-    int swidth = width / 32, sheight = height / 32;
+    int swidth = width / T, sheight = height / T;
     int *idx = (int*)malloc(sheight * swidth * sizeof(int));
     if (rank == 0)
         timer_start(0);
-    photomosaic(img, width, height, dataset, idx);
+    photomosaic(img, width, height, &cache, idx);
     if (rank == 0) 
         printf("Elapsed time: %f sec\n", timer_stop(0));
 
+    // a streamed dataset is only complete once photomosaic() has waited for
+    // its last piece, comparable with the other strategies' load time
+    if (load == DATASET_LOAD_STREAM) {
+        load_time += dataset_load_wait_seconds();
+        MPI_Reduce(&load_time, &max_load_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        if (rank == 0)
+            printf("dataset load (stream) : %f seconds posting and waiting for pieces on the slowest rank\n", max_load_time);
+    }
+
     /*
      * construct output image
      */
@@ -99,13 +138,13 @@ int main(int argc, char **argv) {
         bmp = BMP_Create(width, height, depth);
         for (int sh = 0; sh < sheight; ++sh) {
             for (int sw = 0; sw < swidth; ++sw) {
-                for (int h = 0; h < 32; ++h) {
-                    for (int w = 0; w < 32; ++w) {
+                for (int h = 0; h < T; ++h) {
+                    for (int w = 0; w < T; ++w) {
                         unsigned char rgb[3];
                         for (int c = 0; c < 3; ++c) {
-                            rgb[c] = dataset[((idx[sh * swidth + sw] * 3 + c) * 32 + h) * 32 + w];
+                            rgb[c] = dataset[(((size_t)idx[sh * swidth + sw] * 3 + c) * T + h) * T + w];
                         }
-                        BMP_SetPixelRGB(bmp, sw * 32 + w, sh * 32 + h, rgb[0], rgb[1], rgb[2]);
+                        BMP_SetPixelRGB(bmp, sw * T + w, sh * T + h, rgb[0], rgb[1], rgb[2]);
                     }
                 }
             }
@@ -120,9 +159,9 @@ int main(int argc, char **argv) {
      */
     if (rank == 0) {
         free(img);
-        free(dataset);
         free(idx);
     }
+    dataset_load_close(&cache);
 
     MPI_Finalize();
     return 0;
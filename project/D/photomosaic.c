@@ -1,5 +1,8 @@
 #include "photomosaic.h"
 #include "timer.h"
+#include "kernel_cache.h"
+#include "dataset_load.h"
+#include "tile_memo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,6 +16,36 @@
 #define K 4
 #define NUM_THREADS 32
 
+/*
+ * 1 runs conv_vec / conv_argmin_vec, the variants of conv / conv_argmin that
+ * keep tiles packed as uchar and use vector loads and math (-DCONV_VEC=1)
+ */
+#ifndef CONV_VEC
+#define CONV_VEC 0
+#endif
+
+/*
+ * 1 hands the tiles out on demand: rank 0 keeps a counter over all tiles,
+ * and a rank asks it for its next chunk when it returns the indices of the
+ * last one, so a slow or shared node simply ends up with fewer tiles;
+ * 0 splits the tiles evenly across ranks up front (-DDYNAMIC=0)
+ */
+#ifndef DYNAMIC
+#define DYNAMIC 1
+#endif
+#define CHUNK_MIN (K * BATCH_SIZE)      // one batch per device
+#define CHUNK_MAX (16 * K * BATCH_SIZE) // chunk * filter_size stays within an int count
+
+enum { TAG_REPORT, TAG_RESULT, TAG_ASSIGN, TAG_TILES };
+
+/*
+ * an image with fewer tiles than one round of device batches per rank is
+ * split by dataset instead: each rank uploads 1 / size of the library,
+ * matches every tile against it, and MPI_MINLOC combines the per-rank
+ * (min, idx) pairs on rank 0, lowest index first on equal minima
+ */
+typedef struct { int diff, idx; } minloc_t; // MPI_2INT
+
 typedef unsigned char uchar;
 #define CHECK_ERROR(err) \
     if (err != CL_SUCCESS) { \
@@ -27,125 +60,94 @@ cl_context context;
 cl_command_queue queue[K];
 cl_program program;
 
-size_t binaries_size[K];
-const uchar *binaries[K];
 
 cl_kernel kernel_conv[K], kernel_reduce[K];
+cl_kernel kernel_reduce_final[K]; // NULL if the program lacks it
+cl_kernel kernel_conv_argmin[K];  // NULL if the program lacks it, or reduction_final
 cl_kernel kernel_transpose[K];
 
 cl_mem buf_img[K], buf_dataset[K];
 cl_mem buf_img_t[K], buf_dataset_t[K];
-cl_mem buf_diff[K], buf_idx[K];
+cl_mem buf_diff[K], buf_idx[K]; // no buf_diff with conv_argmin
 cl_mem buf_diff_reduced[K], buf_idx_reduced[K];
 cl_int err;
 
 int *diff_reduced[K], *idx_reduced[K];
 
-char *get_source_code(const char *file_name, size_t *len);
-uchar *get_binary(const char *file_name, size_t *len);
-void setup_opencl(int width, int height);
+/* dataset images [dataset_begin, + dataset_count) in dataset_cols columns of buf_dataset_t */
+static int dataset_begin, dataset_count, dataset_cols;
+
+/*
+ * threads of the host reductions in match_tiles(); in the dynamic mode,
+ * rank 0's worker shares the node with the dispatcher thread
+ */
+static int host_threads = NUM_THREADS;
+
+/* dynamic mode, on rank 0 */
+static int next_tile;
+static double *rank_rate; // tiles per second of each rank's last chunk, 0 until known
+
+/*
+ * the kernel called name, or its _vec variant with CONV_VEC if the program
+ * has it; NULL if the program has neither
+ */
+static cl_kernel create_conv_kernel(const char *name)
+{
+    static int warned = 0;
+    cl_int err_create;
+    cl_kernel kernel;
+    if (CONV_VEC) {
+        char vec_name[64];
+        snprintf(vec_name, sizeof(vec_name), "%s_vec", name);
+        kernel = clCreateKernel(program, vec_name, &err_create);
+        if (err_create == CL_SUCCESS) return kernel;
+        if (!warned++) printf("%s not in the kernel program, using %s\n", vec_name, name);
+    }
+    kernel = clCreateKernel(program, name, &err_create);
+    return (err_create == CL_SUCCESS) ? kernel : NULL;
+}
+
+void setup_opencl(int batch_size, int num_filters, int filter_size);
 void release_opencl();
 size_t round_work_size(size_t work_size, size_t group_size);
 void set_work_size_rounded(size_t *work_size, size_t *group_size, int n);
 
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx)
+/*
+ * columns [begin, begin + count) of the library for rank r of size, in
+ * 64-wide blocks so that each slice is a whole number of conv tiles
+ */
+static void dataset_slice(int r, int size, const dataset_cache_t *cache, int *begin, int *count, int *cols)
 {
-    int size, rank;
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    const int blocks = cache->padd_cols / 64;
+    const int b0 = blocks * r / size, b1 = blocks * (r + 1) / size;
+    const int end = (b1 * 64 < cache->num_images) ? b1 * 64 : cache->num_images;
+    *begin = b0 * 64;
+    *count = (end > *begin) ? end - *begin : 0;
+    *cols = (b1 - b0) * 64;
+}
 
-    const int swidth = width / 32, sheight = height / 32;
+/*
+ * idx[0 .. num_tiles) for the tiles img_t[0 .. num_tiles) against the
+ * dataset images on this rank's devices, in rounds of one batch per device;
+ * first is the position of img_t[0] in the whole image, only used in the
+ * progress lines; with min_diff, the minima are reduced on the host and
+ * kept there too
+ */
+static void match_tiles(const uchar *img_t, int first, int num_tiles, const dataset_cache_t *cache, int rank, int *idx, int *min_diff)
+{
     const int batch_size = BATCH_SIZE;
-    const int num_tiles_all = sheight * swidth;
-    const int filter_size = 3 * 32 * 32;
-    const int num_filters = 60000;
+    const int filter_size = cache->image_size;
+    const int num_filters = dataset_count;
     const int reduction_count = (num_filters + 255) / 256;
-    for (int k = 0; k < K; ++k) {
-        diff_reduced[k] = (int*)malloc(sizeof(int) * batch_size * reduction_count);
-        idx_reduced[k] = (int*)malloc(sizeof(int) * batch_size * reduction_count);
-    }
-
-    uchar *img_t = (uchar*)malloc(sizeof(uchar) * num_tiles_all * filter_size);
-    if (rank == 0) {
-        #pragma omp parallel num_threads(NUM_THREADS)
-        {
-            #pragma omp for schedule(guided) collapse(2)
-            for (int sh = 0; sh < sheight; ++sh) {
-                for (int sw = 0; sw < swidth; ++sw) {
-                    for (int c = 0; c < 3; ++c) {
-                        for (int h = 0; h < 32; ++h) {
-                            for (int w = 0; w < 32; ++w) {
-                                // img_t[sh][sw][c][h][w] = img[sh * 32 + h][sw * 32 + w][c]
-                                img_t[(sh * swidth + sw) * filter_size + (c * 32 + h) * 32 + w] = img[(sh * 32 + h) * width * 3 + (sw * 32 + w) * 3 + c];
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
-
-    int *num_tiles_per_node = (int*)malloc(sizeof(int) * size);
-    int *num_tiles_offset = (int*)malloc(sizeof(int) * size);
-    int *img_t_size = (int*)malloc(sizeof(int) * size);
-    int *img_t_offset = (int*)malloc(sizeof(int) * size);
-    for (int i = 0; i < size; ++i) {
-        num_tiles_per_node[i] = num_tiles_all / size;
-        if (i < num_tiles_all % size) ++num_tiles_per_node[i];
-        num_tiles_offset[i] = (i > 0) ? (num_tiles_offset[i - 1] + num_tiles_per_node[i - 1]) : 0;
-
-        img_t_size[i] = num_tiles_per_node[i] * filter_size;
-        img_t_offset[i] = (i > 0) ? (img_t_offset[i - 1] + img_t_size[i - 1]) : 0;
-    }
-    int num_tiles = num_tiles_per_node[rank];
-
-    MPI_Request request_img_t;
-    MPI_Status status_img_t;
-    MPI_Iscatterv(img_t, img_t_size, img_t_offset, MPI_UNSIGNED_CHAR, img_t, num_tiles * filter_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD, &request_img_t);
-
-    if (rank == 0) {
-        printf("\nNumber of tiles = %d x %d = %d\n", sheight, swidth, num_tiles_all);
-        printf("Number of processors = %d\n", size);
-        for (int i = 0; i < size; ++i) {
-            printf(" - rank %d : %d tiles ( tiles[%d ... %d) )\n", i, num_tiles_per_node[i], num_tiles_offset[i], num_tiles_offset[i] + num_tiles_per_node[i]);
-        }
-        printf("\n");
-    }
-
-    if (rank == 0)
-        timer_start(1);
-    setup_opencl(batch_size, num_filters + 32);
-    if (rank == 0)
-        printf("setup opencl : %f seconds\n\n", timer_stop(1));
-    MPI_Wait(&request_img_t, &status_img_t);
-
-    for (int k = 0; k < K; ++k) {
-        clEnqueueWriteBuffer(
-            queue[k], buf_dataset[k], CL_FALSE,
-            0, sizeof(uchar) * num_filters * filter_size,
-            dataset, 0, NULL, NULL
-        );
-    }
-
-    const int Q = filter_size, R = num_filters + 32;
-    for (int k = 0; k < K; ++k) {
-        size_t gws_trans2[] = {Q, R};
-        size_t lws_trans2[] = {16, 16};
-        err  = clSetKernelArg(kernel_transpose[k], 0, sizeof(cl_mem), &buf_dataset[k]);
-        err |= clSetKernelArg(kernel_transpose[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
-        err |= clSetKernelArg(kernel_transpose[k], 2, sizeof(int), &R);
-        err |= clSetKernelArg(kernel_transpose[k], 3, sizeof(int), &Q);
-        CHECK_ERROR(err);
-        err = clEnqueueNDRangeKernel(
-            queue[k], kernel_transpose[k], 2, NULL, gws_trans2, lws_trans2, 0, NULL, NULL
-        );
-        CHECK_ERROR(err);
-    }
+    const int Q = filter_size, R = dataset_cols;
+    // conv_argmin leaves one partial minimum per 64 dataset images, reduction one per 256
+    const int num_partials = kernel_conv_argmin[0] ? R / 64 : reduction_count;
+    cl_int err; // runs beside the dispatcher thread on rank 0 in the dynamic mode
 
     for (int i = 0; i < num_tiles; i += K * batch_size) {
         const int ntiles = (i + K * batch_size < num_tiles) ? K * batch_size : num_tiles - i;
         printf("[rank %d] Calculate tiles[%d ... %d) (%d, %d / %d)\n",
-            rank, i, i + ntiles, ntiles, i, num_tiles
+            rank, first + i, first + i + ntiles, ntiles, i, num_tiles
         );
 
         int ntiles_per_device[K], ntiles_offset[K];
@@ -162,131 +164,453 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
             clEnqueueWriteBuffer(
                 queue[k], buf_img_t[k], CL_FALSE,
                 0, sizeof(uchar) * ntiles_per_device[k] * filter_size,
-                img_t + (i + ntiles_offset[k]) * filter_size, 0, NULL, NULL
+                img_t + (size_t)(i + ntiles_offset[k]) * filter_size, 0, NULL, NULL
             );
         
             size_t gws_conv[] = {R >> 2, P >> 2};
             size_t lws_conv[] = {16, 16};
-            err  = clSetKernelArg(kernel_conv[k], 0, sizeof(cl_mem), &buf_img_t[k]);
-            err |= clSetKernelArg(kernel_conv[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
-            err |= clSetKernelArg(kernel_conv[k], 2, sizeof(cl_mem), &buf_diff[k]);
-            err |= clSetKernelArg(kernel_conv[k], 3, sizeof(int), &P);
-            err |= clSetKernelArg(kernel_conv[k], 4, sizeof(int), &Q);
-            err |= clSetKernelArg(kernel_conv[k], 5, sizeof(int), &R);
-            CHECK_ERROR(err);
-            err = clEnqueueNDRangeKernel(
-                queue[k], kernel_conv[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
-            );
-            CHECK_ERROR(err);
-
-            size_t gws_reduce[] = {num_filters, ntiles_per_device[k]};
-            size_t lws_reduce[] = {256, 1};
-            set_work_size_rounded(gws_reduce, lws_reduce, 2);
-            err  = clSetKernelArg(kernel_reduce[k], 0, sizeof(cl_mem), &buf_diff[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 1, sizeof(cl_mem), &buf_diff_reduced[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 2, sizeof(cl_mem), &buf_idx_reduced[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 3, sizeof(int) * 256, NULL);
-            err |= clSetKernelArg(kernel_reduce[k], 4, sizeof(int) * 256, NULL);
-            err |= clSetKernelArg(kernel_reduce[k], 5, sizeof(int), &ntiles_per_device[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 6, sizeof(int), &num_filters);
-            err |= clSetKernelArg(kernel_reduce[k], 7, sizeof(int), &R);
-            CHECK_ERROR(err);
-            err = clEnqueueNDRangeKernel(
-                queue[k], kernel_reduce[k], 2, NULL, gws_reduce, lws_reduce, 0, NULL, NULL
-            );
-            CHECK_ERROR(err);
+            if (kernel_conv_argmin[k]) {
+                err  = clSetKernelArg(kernel_conv_argmin[k], 0, sizeof(cl_mem), &buf_img_t[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 2, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 3, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 4, sizeof(int), &P);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 5, sizeof(int), &Q);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 6, sizeof(int), &R);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 7, sizeof(int), &num_filters);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_conv_argmin[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+            }
+            else {
+                err  = clSetKernelArg(kernel_conv[k], 0, sizeof(cl_mem), &buf_img_t[k]);
+                err |= clSetKernelArg(kernel_conv[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
+                err |= clSetKernelArg(kernel_conv[k], 2, sizeof(cl_mem), &buf_diff[k]);
+                err |= clSetKernelArg(kernel_conv[k], 3, sizeof(int), &P);
+                err |= clSetKernelArg(kernel_conv[k], 4, sizeof(int), &Q);
+                err |= clSetKernelArg(kernel_conv[k], 5, sizeof(int), &R);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_conv[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+
+                size_t gws_reduce[] = {num_filters, ntiles_per_device[k]};
+                size_t lws_reduce[] = {256, 1};
+                set_work_size_rounded(gws_reduce, lws_reduce, 2);
+                err  = clSetKernelArg(kernel_reduce[k], 0, sizeof(cl_mem), &buf_diff[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 1, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 2, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 3, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce[k], 4, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce[k], 5, sizeof(int), &ntiles_per_device[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 6, sizeof(int), &num_filters);
+                err |= clSetKernelArg(kernel_reduce[k], 7, sizeof(int), &R);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_reduce[k], 2, NULL, gws_reduce, lws_reduce, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+            }
+
+            if (kernel_reduce_final[k] && !min_diff) {
+                // second-level reduction on the device, only the tile indices come back
+                size_t gws_final[] = {256, ntiles_per_device[k]};
+                size_t lws_final[] = {256, 1};
+                err  = clSetKernelArg(kernel_reduce_final[k], 0, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 1, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 2, sizeof(cl_mem), &buf_idx[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 3, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce_final[k], 4, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce_final[k], 5, sizeof(int), &num_partials);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_reduce_final[k], 2, NULL, gws_final, lws_final, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+                clEnqueueReadBuffer(
+                    queue[k], buf_idx[k], CL_FALSE,
+                    0, sizeof(int) * ntiles_per_device[k],
+                    idx + i + ntiles_offset[k], 0, NULL, NULL
+                );
+                continue;
+            }
 
             clEnqueueReadBuffer(
                 queue[k], buf_diff_reduced[k], CL_FALSE,
-                0, sizeof(int) * ntiles_per_device[k] * reduction_count,
+                0, sizeof(int) * ntiles_per_device[k] * num_partials,
                 diff_reduced[k], 0, NULL, NULL
             );
             clEnqueueReadBuffer(
                 queue[k], buf_idx_reduced[k], CL_FALSE,
-                0, sizeof(int) * ntiles_per_device[k] * reduction_count,
+                0, sizeof(int) * ntiles_per_device[k] * num_partials,
                 idx_reduced[k], 0, NULL, NULL
             );
         }
 
         for (int k = 0; k < K; ++k) {
             clFinish(queue[k]);
-            #pragma omp parallel num_threads(NUM_THREADS)
+            if (kernel_reduce_final[k] && !min_diff) continue;
+            #pragma omp parallel num_threads(host_threads)
             {
                 #pragma omp for schedule(guided)
                 for (int t = 0; t < ntiles_per_device[k]; ++t) {
                     int diff = INT_MAX, min_j = -1;
-                    for (int j = 0; j < reduction_count; ++j) {
-                        if (diff_reduced[k][t * reduction_count + j] < diff) {
-                            diff = diff_reduced[k][t * reduction_count + j];
-                            min_j = idx_reduced[k][t * reduction_count + j];
+                    for (int j = 0; j < num_partials; ++j) {
+                        if (diff_reduced[k][t * num_partials + j] < diff) {
+                            diff = diff_reduced[k][t * num_partials + j];
+                            min_j = idx_reduced[k][t * num_partials + j];
                         }
                     }
-                    idx[i + ntiles_offset[k] + t] = min_j;
+                    idx[i + ntiles_offset[k] + t] = dataset_begin + min_j;
+                    if (min_diff) min_diff[i + ntiles_offset[k] + t] = diff;
                 }
             }
         }
     }
 
     for (int i = 0; i < num_tiles; ++i) {
-        if (idx[i] < 0 || idx[i] >= 60000) {
+        if (idx[i] < 0 || idx[i] >= cache->num_images) {
             printf("Invalid index at i = %d (idx[%d] = %d)\n", i, i, idx[i]);
             idx[i] = 0;
         }
     }
+}
 
-    if (rank == 0)
-        printf("\n");
-    MPI_Gatherv(idx, num_tiles, MPI_INT, idx, num_tiles_per_node, num_tiles_offset, MPI_INT, 0, MPI_COMM_WORLD);
-    release_opencl();
+/*
+ * the next chunk for rank r, once it reports count tiles done in seconds:
+ * half of the remaining tiles are split in proportion to the measured rates
+ * (a rank not measured yet counts as their mean), so chunks follow each
+ * rank's throughput and shrink towards the end; 0 tiles when none are left
+ */
+static void claim_chunk(int r, int size, int num_tiles, int count, double seconds, int *start, int *chunk)
+{
+    #pragma omp critical (dispatch)
+    {
+        if (count > 0 && seconds > 0) rank_rate[r] = count / seconds;
+
+        double known = 0;
+        int num_known = 0;
+        for (int i = 0; i < size; ++i) {
+            if (rank_rate[i] > 0) {
+                known += rank_rate[i];
+                ++num_known;
+            }
+        }
+
+        const int remaining = num_tiles - next_tile;
+        int n = CHUNK_MIN;
+        if (rank_rate[r] > 0) {
+            const double total = known * size / num_known;
+            n = (int)(remaining / 2 * rank_rate[r] / total);
+            if (n < CHUNK_MIN) n = CHUNK_MIN;
+            if (n > CHUNK_MAX) n = CHUNK_MAX;
+        }
+        if (n > remaining) n = remaining;
+
+        *start = next_tile;
+        *chunk = n;
+        next_tile += n;
+    }
 }
 
-char *get_source_code(const char *file_name, size_t *len)
+/*
+ * dynamic mode: the main thread of rank 0 serves chunk requests while a
+ * second thread matches chunks on its own devices, and the other ranks
+ * loop on report, receive, match; idx is complete on rank 0 only
+ */
+static void match_dynamic(uchar *img_t, int num_tiles, const dataset_cache_t *cache, int rank, int size, int *idx)
 {
-    char *source_code;
-    size_t length;
-    FILE *file = fopen(file_name, "r");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
+    const int Q = cache->image_size;
+    if (rank != 0) {
+        double report[3] = {0, 0, 0}; // start, count and seconds of the last chunk
+        while (1) {
+            MPI_Send(report, 3, MPI_DOUBLE, 0, TAG_REPORT, MPI_COMM_WORLD);
+            if (report[1] > 0)
+                MPI_Send(idx, (int)report[1], MPI_INT, 0, TAG_RESULT, MPI_COMM_WORLD);
+
+            int assign[2];
+            MPI_Recv(assign, 2, MPI_INT, 0, TAG_ASSIGN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (assign[1] == 0) break;
+            MPI_Recv(img_t, assign[1] * Q, MPI_UNSIGNED_CHAR, 0, TAG_TILES, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+            const double start = omp_get_wtime();
+            match_tiles(img_t, assign[0], assign[1], cache, rank, idx, NULL);
+            report[0] = assign[0];
+            report[1] = assign[1];
+            report[2] = omp_get_wtime() - start;
+        }
+        return;
     }
 
-    fseek(file, 0, SEEK_END);
-    length = (size_t)ftell(file);
-    rewind(file);
+    next_tile = 0;
+    rank_rate = (double*)calloc(size, sizeof(double));
+    int *tiles_done = (int*)calloc(size, sizeof(int));
+    int *chunks_done = (int*)calloc(size, sizeof(int));
+
+    // the worker's reductions are a team nested in the region below, sized
+    // so that worker and dispatcher together use NUM_THREADS threads
+    host_threads = NUM_THREADS - 1;
+    omp_set_max_active_levels(2);
+    #pragma omp parallel num_threads(2)
+    {
+        if (omp_get_thread_num() == 1) {
+            int start, chunk, count = 0;
+            double seconds = 0;
+            while (1) {
+                claim_chunk(0, size, num_tiles, count, seconds, &start, &chunk);
+                if (chunk == 0) break;
+                const double t = omp_get_wtime();
+                match_tiles(img_t + (size_t)start * Q, start, chunk, cache, 0, idx + start, NULL);
+                seconds = omp_get_wtime() - t;
+                count = chunk;
+                tiles_done[0] += chunk;
+                ++chunks_done[0];
+            }
+        }
+        else {
+            // only this, the main, thread calls MPI (MPI_THREAD_FUNNELED)
+            int active = size - 1;
+            while (active > 0) {
+                double report[3];
+                MPI_Status status;
+                MPI_Recv(report, 3, MPI_DOUBLE, MPI_ANY_SOURCE, TAG_REPORT, MPI_COMM_WORLD, &status);
+                const int r = status.MPI_SOURCE, count = (int)report[1];
+                if (count > 0) {
+                    MPI_Recv(idx + (int)report[0], count, MPI_INT, r, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                    tiles_done[r] += count;
+                    ++chunks_done[r];
+                }
 
-    source_code = (char*)malloc(length + 1);
-    fread(source_code, length, 1, file);
-    source_code[length] = '\0';
+                int assign[2];
+                claim_chunk(r, size, num_tiles, count, report[2], &assign[0], &assign[1]);
+                MPI_Send(assign, 2, MPI_INT, r, TAG_ASSIGN, MPI_COMM_WORLD);
+                if (assign[1] > 0) {
+                    MPI_Send(img_t + (size_t)assign[0] * Q, assign[1] * Q, MPI_UNSIGNED_CHAR, r, TAG_TILES, MPI_COMM_WORLD);
+                }
+                else {
+                    --active;
+                }
+            }
+        }
+    }
 
-    fclose(file);
+    host_threads = NUM_THREADS;
 
-    *len = length;
-    return source_code;
+    printf("\n");
+    for (int i = 0; i < size; ++i) {
+        printf(" - rank %d : %d tiles in %d chunks\n", i, tiles_done[i], chunks_done[i]);
+    }
+    free(rank_rate);
+    free(tiles_done);
+    free(chunks_done);
 }
 
-uchar *get_binary(const char *file_name, size_t *len)
+void photomosaic(unsigned char *img, int width, int height, const dataset_cache_t *cache, int *idx)
 {
-    uchar *binary;
-    size_t binary_size;
-    FILE *file = fopen(file_name, "rb");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
+    int size, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    const int T = cache->tile;
+    const int swidth = width / T, sheight = height / T;
+    const int batch_size = BATCH_SIZE;
+    const int num_tiles_image = sheight * swidth;
+    const int filter_size = cache->image_size;
+    const int num_filters = cache->num_images;
+    const int max_partials = cache->padd_cols / 64; // conv_argmin's, at least reduction's
+    for (int k = 0; k < K; ++k) {
+        diff_reduced[k] = (int*)malloc(sizeof(int) * batch_size * max_partials);
+        idx_reduced[k] = (int*)malloc(sizeof(int) * batch_size * max_partials);
     }
 
-    fseek(file, 0, SEEK_END);
-    binary_size = (size_t)ftell(file);
-    rewind(file);
+    uchar *img_t = (uchar*)malloc(sizeof(uchar) * num_tiles_image * filter_size);
+    if (rank == 0) {
+        #pragma omp parallel num_threads(NUM_THREADS)
+        {
+            #pragma omp for schedule(guided) collapse(2)
+            for (int sh = 0; sh < sheight; ++sh) {
+                for (int sw = 0; sw < swidth; ++sw) {
+                    for (int c = 0; c < 3; ++c) {
+                        for (int h = 0; h < T; ++h) {
+                            for (int w = 0; w < T; ++w) {
+                                // img_t[sh][sw][c][h][w] = img[sh * T + h][sw * T + w][c]
+                                img_t[(size_t)(sh * swidth + sw) * filter_size + (c * T + h) * T + w] = img[(sh * T + h) * width * 3 + (sw * T + w) * 3 + c];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // rank 0 keeps one copy of each repeated tile, only those are sent out and matched
+    tile_memo_t memo;
+    int num_tiles_all = num_tiles_image;
+    if (rank == 0) {
+        tile_memo_init(&memo, cache, 0);
+        num_tiles_all = tile_memo_begin(&memo, img_t, num_tiles_image);
+    }
+    MPI_Bcast(&num_tiles_all, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    const int by_dataset = size > 1 && num_tiles_all < size * K * batch_size;
+    // rank 0's worker thread needs MPI_THREAD_FUNNELED, see main()
+    int thread_level;
+    MPI_Query_thread(&thread_level);
+    const int dynamic = DYNAMIC && !by_dataset && thread_level >= MPI_THREAD_FUNNELED;
+    if (DYNAMIC && !by_dataset && !dynamic && rank == 0)
+        printf("MPI_THREAD_FUNNELED is not supported, splitting the tiles evenly\n");
+    dataset_begin = 0;
+    dataset_count = num_filters;
+    dataset_cols = cache->padd_cols;
+    if (by_dataset) dataset_slice(rank, size, cache, &dataset_begin, &dataset_count, &dataset_cols);
+
+    int *num_tiles_per_node = (int*)malloc(sizeof(int) * size);
+    int *num_tiles_offset = (int*)malloc(sizeof(int) * size);
+    int *img_t_size = (int*)malloc(sizeof(int) * size);
+    int *img_t_offset = (int*)malloc(sizeof(int) * size);
+    for (int i = 0; i < size; ++i) {
+        num_tiles_per_node[i] = num_tiles_all / size;
+        if (i < num_tiles_all % size) ++num_tiles_per_node[i];
+        num_tiles_offset[i] = (i > 0) ? (num_tiles_offset[i - 1] + num_tiles_per_node[i - 1]) : 0;
 
-    binary = (uchar*)malloc(binary_size);
-    fread(binary, binary_size, 1, file);
-    fclose(file);
+        img_t_size[i] = num_tiles_per_node[i] * filter_size;
+        img_t_offset[i] = (i > 0) ? (img_t_offset[i - 1] + img_t_size[i - 1]) : 0;
+    }
+    int num_tiles = num_tiles_per_node[rank];
 
-    *len = binary_size;
-    return binary;
+    MPI_Request request_img_t = MPI_REQUEST_NULL;
+    MPI_Status status_img_t;
+    if (by_dataset) {
+        MPI_Ibcast(img_t, num_tiles_all * filter_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD, &request_img_t);
+    }
+    else if (!dynamic) {
+        // rank 0's share is img_t[0 .. num_tiles) already, and stays in place
+        MPI_Iscatterv(img_t, img_t_size, img_t_offset, MPI_UNSIGNED_CHAR,
+            (rank == 0) ? MPI_IN_PLACE : img_t, num_tiles * filter_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD, &request_img_t);
+    }
+
+    if (rank == 0) {
+        printf("\nNumber of tiles = %d x %d = %d (%d to match)\n", sheight, swidth, num_tiles_image, num_tiles_all);
+        printf("Number of processors = %d\n", size);
+        if (by_dataset) {
+            for (int i = 0; i < size; ++i) {
+                int begin, count, cols;
+                dataset_slice(i, size, cache, &begin, &count, &cols);
+                printf(" - rank %d : all tiles x images[%d ... %d)\n", i, begin, begin + count);
+            }
+        }
+        else if (dynamic) {
+            printf(" - chunks of %d ... %d tiles on demand\n", CHUNK_MIN, CHUNK_MAX);
+        }
+        else {
+            for (int i = 0; i < size; ++i) {
+                printf(" - rank %d : %d tiles ( tiles[%d ... %d) )\n", i, num_tiles_per_node[i], num_tiles_offset[i], num_tiles_offset[i] + num_tiles_per_node[i]);
+            }
+        }
+        printf("\n");
+    }
+
+    if (rank == 0)
+        timer_start(1);
+    setup_opencl(batch_size, cache->padd_cols, filter_size);
+    if (rank == 0)
+        printf("setup opencl : %f seconds\n\n", timer_stop(1));
+    MPI_Wait(&request_img_t, &status_img_t);
+
+    const int Q = filter_size, R = dataset_cols;
+    if (cache->dataset_t && !by_dataset) {
+        // already transposed and padded in the cache file
+        for (int k = 0; k < K; ++k) {
+            clEnqueueWriteBuffer(
+                queue[k], buf_dataset_t[k], CL_FALSE,
+                0, sizeof(uchar) * Q * R,
+                cache->dataset_t, 0, NULL, NULL
+            );
+        }
+    }
+    else {
+        /*
+         * rows of the dataset slice go up one piece at a time as they arrive
+         * (a single piece unless the dataset is streamed, see dataset_load.h),
+         * each transposed into its columns of buf_dataset_t while the next
+         * piece is still being received
+         */
+        const int slice_end = dataset_begin + dataset_count;
+        for (int p = 0; p < dataset_load_num_pieces(); ++p) {
+            int row_begin, row_end;
+            dataset_load_piece(p, &row_begin, &row_end);
+            if (row_begin < dataset_begin) row_begin = dataset_begin;
+            if (row_end > slice_end) row_end = slice_end;
+            if (row_begin >= row_end) continue;
+
+            // columns [first, first + cols) of buf_dataset_t, padded to the 64 of the slice
+            const int first = row_begin - dataset_begin;
+            const int cols = dataset_padd(row_end - dataset_begin, 64) - first;
+            for (int k = 0; k < K; ++k) {
+                clEnqueueWriteBuffer(
+                    queue[k], buf_dataset[k], CL_FALSE,
+                    sizeof(uchar) * first * Q, sizeof(uchar) * (row_end - row_begin) * Q,
+                    cache->dataset + (size_t)row_begin * Q, 0, NULL, NULL
+                );
+
+                size_t offset_trans2[] = {0, first};
+                size_t gws_trans2[] = {Q, cols};
+                size_t lws_trans2[] = {16, 16};
+                err  = clSetKernelArg(kernel_transpose[k], 0, sizeof(cl_mem), &buf_dataset[k]);
+                err |= clSetKernelArg(kernel_transpose[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
+                err |= clSetKernelArg(kernel_transpose[k], 2, sizeof(int), &R);
+                err |= clSetKernelArg(kernel_transpose[k], 3, sizeof(int), &Q);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_transpose[k], 2, offset_trans2, gws_trans2, lws_trans2, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+            }
+        }
+    }
+
+    if (by_dataset) {
+        int *min_diff = (int*)malloc(sizeof(int) * num_tiles_all);
+        minloc_t *local = (minloc_t*)malloc(sizeof(minloc_t) * num_tiles_all);
+        minloc_t *global = (minloc_t*)malloc(sizeof(minloc_t) * num_tiles_all);
+        if (dataset_count > 0)
+            match_tiles(img_t, 0, num_tiles_all, cache, rank, idx, min_diff);
+        for (int t = 0; t < num_tiles_all; ++t) {
+            local[t].diff = (dataset_count > 0) ? min_diff[t] : INT_MAX;
+            local[t].idx = (dataset_count > 0) ? idx[t] : INT_MAX;
+        }
+        MPI_Reduce(local, global, num_tiles_all, MPI_2INT, MPI_MINLOC, 0, MPI_COMM_WORLD);
+        if (rank == 0) {
+            for (int t = 0; t < num_tiles_all; ++t) {
+                idx[t] = global[t].idx;
+            }
+        }
+        free(min_diff);
+        free(local);
+        free(global);
+    }
+    else if (dynamic) {
+        match_dynamic(img_t, num_tiles_all, cache, rank, size, idx);
+    }
+    else {
+        match_tiles(img_t, num_tiles_offset[rank], num_tiles, cache, rank, idx, NULL);
+    }
+
+    if (rank == 0)
+        printf("\n");
+    if (!by_dataset && !dynamic)
+        MPI_Gatherv((rank == 0) ? MPI_IN_PLACE : idx, num_tiles, MPI_INT, idx, num_tiles_per_node, num_tiles_offset, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        tile_memo_end(&memo, idx);
+        tile_memo_release(&memo);
+    }
+    release_opencl();
 }
 
-void setup_opencl(int batch_size, int num_filters)
+void setup_opencl(int batch_size, int num_filters, int filter_size)
 {
     double t9, t10, t11, t12, t13, t14, t15;
 
@@ -307,48 +631,23 @@ void setup_opencl(int batch_size, int num_filters)
 
     /* Compile the kernel code */
     timer_start(13);
-    /*
-    size_t source_size;
-    const char *source_code = get_source_code("kernel.cl.c", &source_size);
-    program = clCreateProgramWithSource(
-        context, 1, &source_code, &source_size, NULL);
-    err = clBuildProgram(program, K, device, "", NULL, NULL);
-    */
-    size_t binary_size;
-    uchar *kernel_binary = get_binary("kernel.bin", &binary_size);
-    for (int k = 0; k < K; ++k) {
-        binaries_size[k] = binary_size;
-        binaries[k] = kernel_binary;
-    }
-    program = clCreateProgramWithBinary(
-        context, 4, device, binaries_size, binaries, NULL, &err);
-    err = clBuildProgram(program, 4, device, "", NULL, NULL);
+    program = kernel_cache_build(context, K, device, "kernel.cl.c", "");
     t13 = timer_stop(13);
-    if (err == CL_BUILD_PROGRAM_FAILURE) {
-        char *log;
-        size_t log_size;
-        clGetProgramBuildInfo(
-            program, device[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        log = (char*)malloc(log_size + 1);
-        clGetProgramBuildInfo(
-            program, device[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        log[log_size] = '\0';
-        printf("Compile error:\n%s\n", log);
-        free(log);
-        exit(EXIT_FAILURE);
-    }
     timer_start(14);
     for (int i = 0; i < K; ++i) {
-        kernel_conv[i] = clCreateKernel(program, "conv", NULL);
+        kernel_conv[i] = create_conv_kernel("conv");
         kernel_reduce[i] = clCreateKernel(program, "reduction", NULL);
         kernel_transpose[i] = clCreateKernel(program, "transpose", NULL);
+        cl_int err_final;
+        kernel_reduce_final[i] = clCreateKernel(program, "reduction_final", &err_final);
+        if (err_final != CL_SUCCESS) kernel_reduce_final[i] = NULL;
+        kernel_conv_argmin[i] = kernel_reduce_final[i] ? create_conv_kernel("conv_argmin") : NULL;
     }
     t14 = timer_stop(14);
  
     /* Create buffer */
     timer_start(15);
-    int filter_size = 3 * 32 * 32;
-    int reduction_count = (num_filters + 255) / 256;
+    int reduction_count = kernel_conv_argmin[0] ? num_filters / 64 : (num_filters + 255) / 256;
     for (int i = 0; i < K; ++i) {
         buf_img_t[i] = clCreateBuffer(
             context, CL_MEM_READ_ONLY, sizeof(uchar) * batch_size * filter_size, NULL, NULL);
@@ -356,8 +655,11 @@ void setup_opencl(int batch_size, int num_filters)
             context, CL_MEM_READ_ONLY, sizeof(uchar) * num_filters * filter_size, NULL, NULL);
         buf_dataset_t[i] = clCreateBuffer(
             context, CL_MEM_READ_ONLY, sizeof(uchar) * filter_size * num_filters, NULL, NULL);
-        buf_diff[i] = clCreateBuffer(
-            context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
+        buf_diff[i] = NULL;
+        if (!kernel_conv_argmin[i]) {
+            buf_diff[i] = clCreateBuffer(
+                context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
+        }
         buf_idx[i] = clCreateBuffer(
             context, CL_MEM_READ_WRITE, sizeof(int) * batch_size, NULL, NULL);
         buf_diff_reduced[i] = clCreateBuffer(
@@ -377,6 +679,10 @@ void setup_opencl(int batch_size, int num_filters)
         printf("BuildProgram : %f seconds\n", t13);
         printf("CreateKernel : %f seconds\n", t14);
         printf("CreateBuffer : %f seconds\n\n", t15);
+        if (!kernel_reduce_final[0])
+            printf("reduction_final not in the kernel program, reducing on the host\n\n");
+        else if (!kernel_conv_argmin[0])
+            printf("conv_argmin not in the kernel program, using conv + reduction\n\n");
     }
 }
 
@@ -387,12 +693,14 @@ void release_opencl()
         clReleaseMemObject(buf_dataset[i]);
         clReleaseMemObject(buf_img_t[i]);
         clReleaseMemObject(buf_dataset_t[i]);
-        clReleaseMemObject(buf_diff[i]);
+        if (buf_diff[i]) clReleaseMemObject(buf_diff[i]);
         clReleaseMemObject(buf_idx[i]);
         clReleaseCommandQueue(queue[i]);
         clReleaseKernel(kernel_transpose[i]);
         clReleaseKernel(kernel_conv[i]);
         clReleaseKernel(kernel_reduce[i]);
+        if (kernel_reduce_final[i]) clReleaseKernel(kernel_reduce_final[i]);
+        if (kernel_conv_argmin[i]) clReleaseKernel(kernel_conv_argmin[i]);
     }
     clReleaseContext(context);
     clReleaseProgram(program);
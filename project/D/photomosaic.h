@@ -1,3 +1,5 @@
 #pragma once
 
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx);
+#include "dataset_cache.h"
+
+void photomosaic(unsigned char *img, int width, int height, const dataset_cache_t *cache, int *idx);
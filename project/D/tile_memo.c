@@ -0,0 +1,275 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "tile_memo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_PATH 4096
+
+static unsigned long long rotl(unsigned long long x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* splitmix64 finalizer */
+static unsigned long long mix(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/*
+ * two independent 64-bit hashes of a tile, a word at a time;
+ * size is 3 x tile x tile, a multiple of 8 for every valid tile
+ */
+static void hash_tile(const unsigned char *p, size_t size, unsigned long long *h)
+{
+    unsigned long long h1 = 14695981039346656037ULL, h2 = size;
+    for (size_t i = 0; i < size; i += 8) {
+        unsigned long long w;
+        memcpy(&w, p + i, sizeof(w));
+        h1 = rotl(h1 ^ w, 27) * 1099511628211ULL;
+        h2 = rotl(h2 + w * 0x9e3779b97f4a7c15ULL, 31) * 0xff51afd7ed558ccdULL;
+    }
+    h[0] = mix(h1);
+    h[1] = mix(h2 ^ h[0]);
+}
+
+/* order-independent combination of the image hashes, one pass in parallel */
+static unsigned long long hash_dataset(const dataset_cache_t *cache)
+{
+    unsigned long long h = mix(((unsigned long long)cache->num_images << 32) | cache->image_size);
+    #pragma omp parallel for reduction(^:h)
+    for (int i = 0; i < cache->num_images; ++i) {
+        unsigned long long hi[2];
+        hash_tile(cache->dataset + (size_t)i * cache->image_size, cache->image_size, hi);
+        h ^= mix(hi[0] + (unsigned long long)i * 0x9e3779b97f4a7c15ULL);
+    }
+    return h;
+}
+
+static tile_memo_entry_t *lookup(const tile_memo_t *memo, const unsigned long long *h)
+{
+    if (memo->capacity == 0) return NULL;
+    const long long mask = memo->capacity - 1;
+    for (long long s = h[0] & mask; memo->table[s].idx >= 0; s = (s + 1) & mask) {
+        if (memo->table[s].h1 == h[0] && memo->table[s].h2 == h[1])
+            return &memo->table[s];
+    }
+    return NULL;
+}
+
+static void insert(tile_memo_t *memo, const unsigned long long *h, int idx);
+
+static void grow(tile_memo_t *memo)
+{
+    tile_memo_entry_t *old = memo->table;
+    const long long old_capacity = memo->capacity;
+
+    memo->capacity = old_capacity ? old_capacity * 2 : 1024;
+    memo->table = (tile_memo_entry_t*)malloc(sizeof(tile_memo_entry_t) * memo->capacity);
+    for (long long s = 0; s < memo->capacity; ++s) {
+        memo->table[s].idx = -1;
+    }
+    memo->count = 0;
+    for (long long s = 0; s < old_capacity; ++s) {
+        if (old[s].idx >= 0) {
+            const unsigned long long h[2] = {old[s].h1, old[s].h2};
+            insert(memo, h, old[s].idx);
+        }
+    }
+    free(old);
+}
+
+static void insert(tile_memo_t *memo, const unsigned long long *h, int idx)
+{
+    if (memo->count >= TILE_MEMO_MAX_ENTRIES) return;
+    if ((memo->count + 1) * 2 > memo->capacity) grow(memo);
+
+    const long long mask = memo->capacity - 1;
+    long long s = h[0] & mask;
+    while (memo->table[s].idx >= 0 && (memo->table[s].h1 != h[0] || memo->table[s].h2 != h[1])) {
+        s = (s + 1) & mask;
+    }
+    if (memo->table[s].idx < 0) memo->count++;
+    memo->table[s].h1 = h[0];
+    memo->table[s].h2 = h[1];
+    memo->table[s].idx = idx;
+}
+
+static void load(tile_memo_t *memo, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return;
+
+    tile_memo_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, TILE_MEMO_MAGIC, sizeof(TILE_MEMO_MAGIC)) != 0
+        || header.version != TILE_MEMO_VERSION
+        || header.count < 0 || header.count > TILE_MEMO_MAX_ENTRIES) {
+        printf("tile memo : %s is not a tile memo, starting empty\n", path);
+        fclose(file);
+        return;
+    }
+    if (header.tile != memo->tile || header.num_images != memo->num_images || header.dataset_hash != memo->dataset_hash) {
+        printf("tile memo : %s is for another dataset, starting empty\n", path);
+        fclose(file);
+        return;
+    }
+
+    tile_memo_entry_t entry;
+    long long n = 0;
+    while (n < header.count && fread(&entry, sizeof(entry), 1, file) == 1) {
+        if (entry.idx >= 0 && entry.idx < memo->num_images) {
+            const unsigned long long h[2] = {entry.h1, entry.h2};
+            insert(memo, h, entry.idx);
+        }
+        n++;
+    }
+    fclose(file);
+    printf("tile memo : %lld results from %s\n", memo->count, path);
+}
+
+/* a temporary file is renamed into place, as in kernel_cache.c */
+static void save(const tile_memo_t *memo, const char *path)
+{
+    tile_memo_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TILE_MEMO_MAGIC, sizeof(TILE_MEMO_MAGIC));
+    header.version = TILE_MEMO_VERSION;
+    header.tile = memo->tile;
+    header.num_images = memo->num_images;
+    header.dataset_hash = memo->dataset_hash;
+    header.count = memo->count;
+
+    char tmp_path[MAX_PATH + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+    FILE *file = fopen(tmp_path, "wb");
+    int ok = file && fwrite(&header, sizeof(header), 1, file) == 1;
+    for (long long s = 0; ok && s < memo->capacity; ++s) {
+        if (memo->table[s].idx >= 0)
+            ok = fwrite(&memo->table[s], sizeof(tile_memo_entry_t), 1, file) == 1;
+    }
+    if (file && fclose(file) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) != 0) {
+        printf("tile memo : cannot write %s\n", path);
+        remove(tmp_path);
+    }
+}
+
+void tile_memo_init(tile_memo_t *memo, const dataset_cache_t *cache, int resident)
+{
+    memset(memo, 0, sizeof(*memo));
+    memo->tile_size = cache->image_size;
+    memo->tile = cache->tile;
+    memo->num_images = cache->num_images;
+    memo->keep = TILE_MEMO && (resident || TILE_MEMO_PERSIST);
+    if (TILE_MEMO && TILE_MEMO_PERSIST) {
+        memo->dataset_hash = hash_dataset(cache);
+        load(memo, TILE_MEMO_PATH);
+    }
+}
+
+int tile_memo_begin(tile_memo_t *memo, unsigned char *img_t, int num_tiles)
+{
+    memo->num_tiles = num_tiles;
+    if (!TILE_MEMO) return num_tiles;
+
+    const size_t size = memo->tile_size;
+    const int n = num_tiles > 0 ? num_tiles : 1;
+    memo->hash = (unsigned long long*)realloc(memo->hash, sizeof(unsigned long long) * 2 * n);
+    memo->of = (int*)realloc(memo->of, sizeof(int) * n);
+    memo->first = (int*)realloc(memo->first, sizeof(int) * n);
+    #pragma omp parallel for
+    for (int t = 0; t < num_tiles; ++t) {
+        hash_tile(img_t + (size_t)t * size, size, memo->hash + 2 * t);
+    }
+
+    // first occurrence of every distinct tile; equal hashes are confirmed
+    // with memcmp, so two tiles of one run never share a result by accident
+    long long capacity = 1;
+    while (capacity < 2LL * n) capacity <<= 1;
+    const long long mask = capacity - 1;
+    int *slots = (int*)malloc(sizeof(int) * capacity);
+    memset(slots, 0xff, sizeof(int) * capacity);
+
+    int num_unique = 0;
+    for (int t = 0; t < num_tiles; ++t) {
+        const unsigned long long *h = memo->hash + 2 * t;
+        long long s = h[0] & mask;
+        for (; slots[s] >= 0; s = (s + 1) & mask) {
+            const int f = memo->first[slots[s]];
+            if (memo->hash[2 * f] == h[0] && memo->hash[2 * f + 1] == h[1]
+                && memcmp(img_t + (size_t)f * size, img_t + (size_t)t * size, size) == 0)
+                break;
+        }
+        if (slots[s] < 0) {
+            slots[s] = num_unique;
+            memo->first[num_unique++] = t;
+        }
+        memo->of[t] = slots[s];
+    }
+    free(slots);
+
+    // tiles left to match move to the front in order; the slot a tile moves
+    // to never holds the first occurrence of a later distinct tile
+    memo->num_unique = num_unique;
+    memo->result = (int*)realloc(memo->result, sizeof(int) * n);
+    memo->pos = (int*)realloc(memo->pos, sizeof(int) * n);
+    int num_match = 0;
+    for (int u = 0; u < num_unique; ++u) {
+        const int t = memo->first[u];
+        const tile_memo_entry_t *e = lookup(memo, memo->hash + 2 * t);
+        if (e) {
+            memo->result[u] = e->idx;
+            memo->pos[u] = -1;
+            continue;
+        }
+        if (num_match != t)
+            memcpy(img_t + (size_t)num_match * size, img_t + (size_t)t * size, size);
+        memo->pos[u] = num_match++;
+    }
+    memo->num_match = num_match;
+
+    printf("tile memo : %d tiles, %d distinct, %d matched before\n",
+        num_tiles, num_unique, num_unique - num_match);
+    return num_match;
+}
+
+void tile_memo_end(tile_memo_t *memo, int *idx)
+{
+    if (!TILE_MEMO) return;
+
+    for (int u = 0; u < memo->num_unique; ++u) {
+        if (memo->pos[u] < 0) continue;
+        memo->result[u] = idx[memo->pos[u]];
+        if (memo->keep) {
+            insert(memo, memo->hash + 2 * memo->first[u], memo->result[u]);
+            memo->dirty = 1;
+        }
+    }
+    for (int t = 0; t < memo->num_tiles; ++t) {
+        idx[t] = memo->result[memo->of[t]];
+    }
+}
+
+void tile_memo_release(tile_memo_t *memo)
+{
+    if (TILE_MEMO && TILE_MEMO_PERSIST && memo->dirty)
+        save(memo, TILE_MEMO_PATH);
+
+    free(memo->table);
+    free(memo->hash);
+    free(memo->of);
+    free(memo->first);
+    free(memo->result);
+    free(memo->pos);
+    memset(memo, 0, sizeof(*memo));
+}
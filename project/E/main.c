@@ -1,13 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "photomosaic.h"
 #include "timer.h"
 #include "qdbmp.h"
 
 int main(int argc, char **argv) {
+    /*
+     * options : -t tile size, -d tile library (its cache file is looked up next to it)
+     */
+    int T = DATASET_DEFAULT_TILE;
+    const char *dataset_path = DATASET_DEFAULT_PATH;
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-t") == 0) T = atoi(argv[2]);
+        else if (strcmp(argv[1], "-d") == 0) dataset_path = argv[2];
+        else break;
+        argc -= 2;
+        argv += 2;
+    }
     if (argc != 3) {
-        printf("Usage : %s [input.bmp] [output.bmp]\n", argv[0]);
+        printf("Usage : %s [-t tile] [-d dataset.bin] [input.bmp] [output.bmp]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -22,8 +35,8 @@ int main(int argc, char **argv) {
     int height = BMP_GetHeight(bmp);
     int depth = BMP_GetDepth(bmp);
     printf("image read success; image = %s, width = %d, height = %d, depth = %d\n", argv[1], width, height, depth);
-    if (width % 32 != 0 || height % 32 != 0) {
-        printf("width and height should be multiple of 32.\n");
+    if (width % T != 0 || height % T != 0) {
+        printf("width and height should be multiple of %d.\n", T);
         exit(EXIT_FAILURE);
     }
     if (depth != 24) {
@@ -42,28 +55,28 @@ int main(int argc, char **argv) {
     BMP_Free(bmp);
 
     /*
-     * read cifar-10 dataset
+     * read the tile library
      */
 
-    unsigned char *dataset = (unsigned char*)malloc(60000 * 3 * 32 * 32);
-    FILE *fin = fopen("data/cifar-10.bin", "rb");
-    if (!fin) {
-        printf("cifar-10.bin not found\n");
+    dataset_cache_t cache;
+    char cache_path[4096];
+    dataset_cache_path(cache_path, sizeof(cache_path), dataset_path);
+    if (dataset_cache_open(&cache, cache_path, dataset_path, T) != 0) {
+        printf("%s not found\n", dataset_path);
         exit(EXIT_FAILURE);
     }
-    fread(dataset, 1, 60000 * 3 * 32 * 32, fin);
-    fclose(fin);
+    const unsigned char *dataset = cache.dataset;
 
-    printf("dataset read success\n");
+    printf("dataset read success; %d images of %d x %d%s\n", cache.num_images, T, T, cache.map ? " (mapped cache)" : "");
 
     /*
      * photomosaic computation
      */
 
-    int swidth = width / 32, sheight = height / 32;
+    int swidth = width / T, sheight = height / T;
     int *idx = (int*)malloc(sheight * swidth * sizeof(int));
     timer_start(0);
-    photomosaic(img, width, height, dataset, idx);
+    photomosaic(img, width, height, &cache, idx);
     printf("Elapsed time: %f sec\n", timer_stop(0));
 
     /*
@@ -73,13 +86,13 @@ int main(int argc, char **argv) {
     bmp = BMP_Create(width, height, depth);
     for (int sh = 0; sh < sheight; ++sh) {
         for (int sw = 0; sw < swidth; ++sw) {
-            for (int h = 0; h < 32; ++h) {
-                for (int w = 0; w < 32; ++w) {
+            for (int h = 0; h < T; ++h) {
+                for (int w = 0; w < T; ++w) {
                     unsigned char rgb[3];
                     for (int c = 0; c < 3; ++c) {
-                        rgb[c] = dataset[((idx[sh * swidth + sw] * 3 + c) * 32 + h) * 32 + w];
+                        rgb[c] = dataset[(((size_t)idx[sh * swidth + sw] * 3 + c) * T + h) * T + w];
                     }
-                    BMP_SetPixelRGB(bmp, sw * 32 + w, sh * 32 + h, rgb[0], rgb[1], rgb[2]);
+                    BMP_SetPixelRGB(bmp, sw * T + w, sh * T + h, rgb[0], rgb[1], rgb[2]);
                 }
             }
         }
@@ -93,7 +106,7 @@ int main(int argc, char **argv) {
      */
 
     free(img);
-    free(dataset);
+    dataset_cache_close(&cache);
     free(idx);
 
     return 0;
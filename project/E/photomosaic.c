@@ -1,5 +1,7 @@
 #include "photomosaic.h"
 #include "timer.h"
+#include "kernel_cache.h"
+#include "tile_memo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +14,14 @@
 #define K 4
 #define NUM_THREADS 32
 
+/*
+ * 1 runs conv_vec / conv_argmin_vec, the variants of conv / conv_argmin that
+ * keep tiles packed as uchar and use vector loads and math (-DCONV_VEC=1)
+ */
+#ifndef CONV_VEC
+#define CONV_VEC 0
+#endif
+
 typedef unsigned char uchar;
 #define CHECK_ERROR(err) \
     if (err != CL_SUCCESS) { \
@@ -26,34 +36,53 @@ cl_context context;
 cl_command_queue queue[K];
 cl_program program;
 
-size_t binaries_size[K];
-const uchar *binaries[K];
 
 cl_kernel kernel_conv[K], kernel_reduce[K];
+cl_kernel kernel_reduce_final[K]; // NULL if the program lacks it
+cl_kernel kernel_conv_argmin[K];  // NULL if the program lacks it, or reduction_final
 cl_kernel kernel_transpose[K];
 
 cl_mem buf_img[K], buf_dataset[K];
 cl_mem buf_img_t[K], buf_dataset_t[K];
-cl_mem buf_diff[K], buf_idx[K];
+cl_mem buf_diff[K], buf_idx[K]; // no buf_diff with conv_argmin
 cl_mem buf_diff_reduced[K], buf_idx_reduced[K];
 cl_int err;
 
 int *diff_reduced[K], *idx_reduced[K];
 
-char *get_source_code(const char *file_name, size_t *len);
-uchar *get_binary(const char *file_name, size_t *len);
-void setup_opencl(int width, int height);
+/*
+ * the kernel called name, or its _vec variant with CONV_VEC if the program
+ * has it; NULL if the program has neither
+ */
+static cl_kernel create_conv_kernel(const char *name)
+{
+    static int warned = 0;
+    cl_int err_create;
+    cl_kernel kernel;
+    if (CONV_VEC) {
+        char vec_name[64];
+        snprintf(vec_name, sizeof(vec_name), "%s_vec", name);
+        kernel = clCreateKernel(program, vec_name, &err_create);
+        if (err_create == CL_SUCCESS) return kernel;
+        if (!warned++) printf("%s not in the kernel program, using %s\n", vec_name, name);
+    }
+    kernel = clCreateKernel(program, name, &err_create);
+    return (err_create == CL_SUCCESS) ? kernel : NULL;
+}
+
+void setup_opencl(int batch_size, int num_filters, int filter_size);
 void release_opencl();
 size_t round_work_size(size_t work_size, size_t group_size);
 void set_work_size_rounded(size_t *work_size, size_t *group_size, int n);
 
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx)
+void photomosaic(unsigned char *img, int width, int height, const dataset_cache_t *cache, int *idx)
 {
-    const int swidth = width / 32, sheight = height / 32;
+    const int T = cache->tile;
+    const int swidth = width / T, sheight = height / T;
     const int batch_size = BATCH_SIZE;
     const int num_tiles = sheight * swidth;
-    const int filter_size = 3 * 32 * 32;
-    const int num_filters = 60000;
+    const int filter_size = cache->image_size;
+    const int num_filters = cache->num_images;
     const int reduction_count = (num_filters + 255) / 256;
     for (int k = 0; k < K; ++k) {
         diff_reduced[k] = (int*)malloc(sizeof(int) * batch_size * reduction_count);
@@ -61,7 +90,7 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
     }
 
     timer_start(1);
-    setup_opencl(batch_size, num_filters + 32);
+    setup_opencl(batch_size, cache->padd_cols, filter_size);
     printf("setup opencl : %f seconds\n\n", timer_stop(1));
 
     uchar *img_t = (uchar*)malloc(sizeof(uchar) * num_tiles * filter_size);
@@ -71,10 +100,10 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
         for (int sh = 0; sh < sheight; ++sh) {
             for (int sw = 0; sw < swidth; ++sw) {
                 for (int c = 0; c < 3; ++c) {
-                    for (int h = 0; h < 32; ++h) {
-                        for (int w = 0; w < 32; ++w) {
-                            // img_t[sh][sw][c][h][w] = img[sh * 32 + h][sw * 32 + w][c]
-                            img_t[(sh * swidth + sw) * filter_size + (c * 32 + h) * 32 + w] = img[(sh * 32 + h) * width * 3 + (sw * 32 + w) * 3 + c];
+                    for (int h = 0; h < T; ++h) {
+                        for (int w = 0; w < T; ++w) {
+                            // img_t[sh][sw][c][h][w] = img[sh * T + h][sw * T + w][c]
+                            img_t[(size_t)(sh * swidth + sw) * filter_size + (c * T + h) * T + w] = img[(sh * T + h) * width * 3 + (sw * T + w) * 3 + c];
                         }
                     }
                 }
@@ -82,16 +111,30 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
         }
     }
 
+    tile_memo_t memo;
+    tile_memo_init(&memo, cache, 0);
+    const int num_match = tile_memo_begin(&memo, img_t, num_tiles);
+
+    const int Q = filter_size, R = cache->padd_cols;
+    // conv_argmin leaves one partial minimum per 64 dataset images, reduction one per 256
+    const int num_partials = kernel_conv_argmin[0] ? R / 64 : reduction_count;
     for (int k = 0; k < K; ++k) {
+        if (cache->dataset_t) {
+            // already transposed and padded in the cache file
+            clEnqueueWriteBuffer(
+                queue[k], buf_dataset_t[k], CL_FALSE,
+                0, sizeof(uchar) * Q * R,
+                cache->dataset_t, 0, NULL, NULL
+            );
+            continue;
+        }
+
         clEnqueueWriteBuffer(
             queue[k], buf_dataset[k], CL_FALSE,
             0, sizeof(uchar) * num_filters * filter_size,
-            dataset, 0, NULL, NULL
+            cache->dataset, 0, NULL, NULL
         );
-    }
 
-    const int Q = filter_size, R = num_filters + 32;
-    for (int k = 0; k < K; ++k) {
         size_t gws_trans2[] = {Q, R};
         size_t lws_trans2[] = {16, 16};
         err  = clSetKernelArg(kernel_transpose[k], 0, sizeof(cl_mem), &buf_dataset[k]);
@@ -105,11 +148,11 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
         CHECK_ERROR(err);
     }
 
-    printf("Number of tiles = %d x %d = %d\n", sheight, swidth, num_tiles);
-    for (int i = 0; i < num_tiles; i += K * batch_size) {
-        const int ntiles = (i + K * batch_size < num_tiles) ? K * batch_size : num_tiles - i;
+    printf("Number of tiles = %d x %d = %d (%d to match)\n", sheight, swidth, num_tiles, num_match);
+    for (int i = 0; i < num_match; i += K * batch_size) {
+        const int ntiles = (i + K * batch_size < num_match) ? K * batch_size : num_match - i;
         printf("Calculate tiles[%d ... %d] (%d, %d / %d)\n",
-            i, i + ntiles, ntiles, i, num_tiles
+            i, i + ntiles, ntiles, i, num_match
         );
 
         int ntiles_per_device[K], ntiles_offset[K];
@@ -126,39 +169,79 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
             clEnqueueWriteBuffer(
                 queue[k], buf_img_t[k], CL_FALSE,
                 0, sizeof(uchar) * ntiles_per_device[k] * filter_size,
-                img_t + (i + ntiles_offset[k]) * filter_size, 0, NULL, NULL
+                img_t + (size_t)(i + ntiles_offset[k]) * filter_size, 0, NULL, NULL
             );
         
             size_t gws_conv[] = {R >> 2, P >> 2};
             size_t lws_conv[] = {16, 16};
-            err  = clSetKernelArg(kernel_conv[k], 0, sizeof(cl_mem), &buf_img_t[k]);
-            err |= clSetKernelArg(kernel_conv[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
-            err |= clSetKernelArg(kernel_conv[k], 2, sizeof(cl_mem), &buf_diff[k]);
-            err |= clSetKernelArg(kernel_conv[k], 3, sizeof(int), &P);
-            err |= clSetKernelArg(kernel_conv[k], 4, sizeof(int), &Q);
-            err |= clSetKernelArg(kernel_conv[k], 5, sizeof(int), &R);
-            CHECK_ERROR(err);
-            err = clEnqueueNDRangeKernel(
-                queue[k], kernel_conv[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
-            );
-            CHECK_ERROR(err);
-
-            size_t gws_reduce[] = {num_filters, ntiles_per_device[k]};
-            size_t lws_reduce[] = {256, 1};
-            set_work_size_rounded(gws_reduce, lws_reduce, 2);
-            err  = clSetKernelArg(kernel_reduce[k], 0, sizeof(cl_mem), &buf_diff[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 1, sizeof(cl_mem), &buf_diff_reduced[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 2, sizeof(cl_mem), &buf_idx_reduced[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 3, sizeof(int) * 256, NULL);
-            err |= clSetKernelArg(kernel_reduce[k], 4, sizeof(int) * 256, NULL);
-            err |= clSetKernelArg(kernel_reduce[k], 5, sizeof(int), &ntiles_per_device[k]);
-            err |= clSetKernelArg(kernel_reduce[k], 6, sizeof(int), &num_filters);
-            err |= clSetKernelArg(kernel_reduce[k], 7, sizeof(int), &R);
-            CHECK_ERROR(err);
-            err = clEnqueueNDRangeKernel(
-                queue[k], kernel_reduce[k], 2, NULL, gws_reduce, lws_reduce, 0, NULL, NULL
-            );
-            CHECK_ERROR(err);
+            if (kernel_conv_argmin[k]) {
+                err  = clSetKernelArg(kernel_conv_argmin[k], 0, sizeof(cl_mem), &buf_img_t[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 2, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 3, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 4, sizeof(int), &P);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 5, sizeof(int), &Q);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 6, sizeof(int), &R);
+                err |= clSetKernelArg(kernel_conv_argmin[k], 7, sizeof(int), &num_filters);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_conv_argmin[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+            }
+            else {
+                err  = clSetKernelArg(kernel_conv[k], 0, sizeof(cl_mem), &buf_img_t[k]);
+                err |= clSetKernelArg(kernel_conv[k], 1, sizeof(cl_mem), &buf_dataset_t[k]);
+                err |= clSetKernelArg(kernel_conv[k], 2, sizeof(cl_mem), &buf_diff[k]);
+                err |= clSetKernelArg(kernel_conv[k], 3, sizeof(int), &P);
+                err |= clSetKernelArg(kernel_conv[k], 4, sizeof(int), &Q);
+                err |= clSetKernelArg(kernel_conv[k], 5, sizeof(int), &R);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_conv[k], 2, NULL, gws_conv, lws_conv, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+
+                size_t gws_reduce[] = {num_filters, ntiles_per_device[k]};
+                size_t lws_reduce[] = {256, 1};
+                set_work_size_rounded(gws_reduce, lws_reduce, 2);
+                err  = clSetKernelArg(kernel_reduce[k], 0, sizeof(cl_mem), &buf_diff[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 1, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 2, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 3, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce[k], 4, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce[k], 5, sizeof(int), &ntiles_per_device[k]);
+                err |= clSetKernelArg(kernel_reduce[k], 6, sizeof(int), &num_filters);
+                err |= clSetKernelArg(kernel_reduce[k], 7, sizeof(int), &R);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_reduce[k], 2, NULL, gws_reduce, lws_reduce, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+            }
+
+            if (kernel_reduce_final[k]) {
+                // second-level reduction on the device, only the tile indices come back
+                size_t gws_final[] = {256, ntiles_per_device[k]};
+                size_t lws_final[] = {256, 1};
+                err  = clSetKernelArg(kernel_reduce_final[k], 0, sizeof(cl_mem), &buf_diff_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 1, sizeof(cl_mem), &buf_idx_reduced[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 2, sizeof(cl_mem), &buf_idx[k]);
+                err |= clSetKernelArg(kernel_reduce_final[k], 3, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce_final[k], 4, sizeof(int) * 256, NULL);
+                err |= clSetKernelArg(kernel_reduce_final[k], 5, sizeof(int), &num_partials);
+                CHECK_ERROR(err);
+                err = clEnqueueNDRangeKernel(
+                    queue[k], kernel_reduce_final[k], 2, NULL, gws_final, lws_final, 0, NULL, NULL
+                );
+                CHECK_ERROR(err);
+                clEnqueueReadBuffer(
+                    queue[k], buf_idx[k], CL_FALSE,
+                    0, sizeof(int) * ntiles_per_device[k],
+                    idx + i + ntiles_offset[k], 0, NULL, NULL
+                );
+                continue;
+            }
 
             clEnqueueReadBuffer(
                 queue[k], buf_diff_reduced[k], CL_FALSE,
@@ -174,6 +257,7 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
 
         for (int k = 0; k < K; ++k) {
             clFinish(queue[k]);
+            if (kernel_reduce_final[k]) continue;
             #pragma omp parallel num_threads(NUM_THREADS)
             {
                 #pragma omp for schedule(guided)
@@ -190,58 +274,14 @@ void photomosaic(unsigned char *img, int width, int height, unsigned char *datas
             }
         }
     }
+    tile_memo_end(&memo, idx);
+    tile_memo_release(&memo);
 
     printf("\n");
     release_opencl();
 }
 
-char *get_source_code(const char *file_name, size_t *len)
-{
-    char *source_code;
-    size_t length;
-    FILE *file = fopen(file_name, "r");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
-    }
-
-    fseek(file, 0, SEEK_END);
-    length = (size_t)ftell(file);
-    rewind(file);
-
-    source_code = (char*)malloc(length + 1);
-    fread(source_code, length, 1, file);
-    source_code[length] = '\0';
-
-    fclose(file);
-
-    *len = length;
-    return source_code;
-}
-
-uchar *get_binary(const char *file_name, size_t *len)
-{
-    uchar *binary;
-    size_t binary_size;
-    FILE *file = fopen(file_name, "rb");
-    if (file == NULL) {
-        printf("[%s:%d] Failed to open %s\n", __FILE__, __LINE__, file_name);
-        exit(EXIT_FAILURE);
-    }
-
-    fseek(file, 0, SEEK_END);
-    binary_size = (size_t)ftell(file);
-    rewind(file);
-
-    binary = (uchar*)malloc(binary_size);
-    fread(binary, binary_size, 1, file);
-    fclose(file);
-
-    *len = binary_size;
-    return binary;
-}
-
-void setup_opencl(int batch_size, int num_filters)
+void setup_opencl(int batch_size, int num_filters, int filter_size)
 {
     /* Get platform, device, context, command_queue */
     timer_start(9);
@@ -260,48 +300,27 @@ void setup_opencl(int batch_size, int num_filters)
 
     /* Compile the kernel code */
     timer_start(13);
-    /*
-    size_t source_size;
-    const char *source_code = get_source_code("kernel.cl.c", &source_size);
-    program = clCreateProgramWithSource(
-        context, 1, &source_code, &source_size, NULL);
-    err = clBuildProgram(program, K, device, "", NULL, NULL);
-    */
-    size_t binary_size;
-    uchar *kernel_binary = get_binary("kernel.bin", &binary_size);
-    for (int k = 0; k < K; ++k) {
-        binaries_size[k] = binary_size;
-        binaries[k] = kernel_binary;
-    }
-    program = clCreateProgramWithBinary(
-        context, K, device, binaries_size, binaries, NULL, &err);
-    err = clBuildProgram(program, K, device, "", NULL, NULL);
+    program = kernel_cache_build(context, K, device, "kernel.cl.c", "");
     printf("BuildProgram : %f seconds\n", timer_stop(13));
-    if (err == CL_BUILD_PROGRAM_FAILURE) {
-        char *log;
-        size_t log_size;
-        clGetProgramBuildInfo(
-            program, device[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        log = (char*)malloc(log_size + 1);
-        clGetProgramBuildInfo(
-            program, device[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        log[log_size] = '\0';
-        printf("Compile error:\n%s\n", log);
-        free(log);
-        exit(EXIT_FAILURE);
-    }
     timer_start(14);
     for (int i = 0; i < K; ++i) {
-        kernel_conv[i] = clCreateKernel(program, "conv", NULL);
+        kernel_conv[i] = create_conv_kernel("conv");
         kernel_reduce[i] = clCreateKernel(program, "reduction", NULL);
         kernel_transpose[i] = clCreateKernel(program, "transpose", NULL);
+        cl_int err_final;
+        kernel_reduce_final[i] = clCreateKernel(program, "reduction_final", &err_final);
+        if (err_final != CL_SUCCESS) kernel_reduce_final[i] = NULL;
+        kernel_conv_argmin[i] = kernel_reduce_final[i] ? create_conv_kernel("conv_argmin") : NULL;
     }
+    if (!kernel_reduce_final[0])
+        printf("reduction_final not in the kernel program, reducing on the host\n");
+    else if (!kernel_conv_argmin[0])
+        printf("conv_argmin not in the kernel program, using conv + reduction\n");
     printf("CreateKernel : %f seconds\n", timer_stop(14));
  
     /* Create buffer */
     timer_start(15);
-    int filter_size = 3 * 32 * 32;
-    int reduction_count = (num_filters + 255) / 256;
+    int reduction_count = kernel_conv_argmin[0] ? num_filters / 64 : (num_filters + 255) / 256;
     for (int i = 0; i < K; ++i) {
         buf_img_t[i] = clCreateBuffer(
             context, CL_MEM_READ_ONLY, sizeof(uchar) * batch_size * filter_size, NULL, NULL);
@@ -309,8 +328,11 @@ void setup_opencl(int batch_size, int num_filters)
             context, CL_MEM_READ_ONLY, sizeof(uchar) * num_filters * filter_size, NULL, NULL);
         buf_dataset_t[i] = clCreateBuffer(
             context, CL_MEM_READ_ONLY, sizeof(uchar) * filter_size * num_filters, NULL, NULL);
-        buf_diff[i] = clCreateBuffer(
-            context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
+        buf_diff[i] = NULL;
+        if (!kernel_conv_argmin[i]) {
+            buf_diff[i] = clCreateBuffer(
+                context, CL_MEM_READ_WRITE, sizeof(int) * batch_size * num_filters, NULL, NULL);
+        }
         buf_idx[i] = clCreateBuffer(
             context, CL_MEM_READ_WRITE, sizeof(int) * batch_size, NULL, NULL);
         buf_diff_reduced[i] = clCreateBuffer(
@@ -328,12 +350,14 @@ void release_opencl()
         clReleaseMemObject(buf_dataset[i]);
         clReleaseMemObject(buf_img_t[i]);
         clReleaseMemObject(buf_dataset_t[i]);
-        clReleaseMemObject(buf_diff[i]);
+        if (buf_diff[i]) clReleaseMemObject(buf_diff[i]);
         clReleaseMemObject(buf_idx[i]);
         clReleaseCommandQueue(queue[i]);
         clReleaseKernel(kernel_transpose[i]);
         clReleaseKernel(kernel_conv[i]);
         clReleaseKernel(kernel_reduce[i]);
+        if (kernel_reduce_final[i]) clReleaseKernel(kernel_reduce_final[i]);
+        if (kernel_conv_argmin[i]) clReleaseKernel(kernel_conv_argmin[i]);
     }
     clReleaseContext(context);
     clReleaseProgram(program);
@@ -0,0 +1,225 @@
+#include "dataset_load.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+enum { LOAD_FAILED = -1, LOAD_MAPPED, LOAD_SHARED };
+
+static const char *load_names[DATASET_NUM_LOADS] = {"read", "bcast", "node", "hier", "stream"};
+
+/* node and hier */
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static MPI_Win win = MPI_WIN_NULL;
+
+/* rows [i * piece_rows, (i + 1) * piece_rows) of total_rows, piece_requests for stream */
+static int piece_rows, total_rows, num_pieces;
+static MPI_Request *piece_requests;
+static double wait_seconds;
+
+int dataset_load_parse(const char *name)
+{
+    for (int i = 0; i < DATASET_NUM_LOADS; ++i) {
+        if (strcmp(name, load_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char *dataset_load_name(int load)
+{
+    return (load >= 0 && load < DATASET_NUM_LOADS) ? load_names[load] : "?";
+}
+
+static void init_geometry(dataset_cache_t *cache, int num_images, int tile)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->num_images = num_images;
+    cache->tile = tile;
+    cache->image_size = 3 * tile * tile;
+    cache->padd_rows = dataset_padd(num_images, DATASET_PADD_ROWS_ALIGN);
+    cache->padd_cols = dataset_padd(num_images, DATASET_PADD_COLS_ALIGN);
+}
+
+static void bcast_chunked(unsigned char *data, size_t size, MPI_Comm comm)
+{
+    for (size_t offset = 0; offset < size; offset += DATASET_BCAST_CHUNK) {
+        size_t n = (size - offset < DATASET_BCAST_CHUNK) ? size - offset : DATASET_BCAST_CHUNK;
+        MPI_Bcast(data + offset, (int)n, MPI_UNSIGNED_CHAR, 0, comm);
+    }
+}
+
+static int open_read(dataset_cache_t *cache, const char *cache_path, const char *raw_path, int tile)
+{
+    return dataset_cache_open(cache, cache_path, raw_path, tile);
+}
+
+static int open_bcast(dataset_cache_t *cache, const char *cache_path, const char *raw_path, int tile, int stream)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    int info[2] = {LOAD_FAILED, 0}; // {status, num_images}
+    if (rank == 0 && dataset_cache_open(cache, cache_path, raw_path, tile) == 0) {
+        info[0] = LOAD_SHARED;
+        info[1] = cache->num_images;
+    }
+    MPI_Bcast(info, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    if (info[0] == LOAD_FAILED) return -1;
+
+    if (rank != 0) {
+        init_geometry(cache, info[1], tile);
+        cache->buf = (unsigned char*)malloc((size_t)cache->padd_rows * cache->image_size);
+        cache->dataset = cache->buf;
+    }
+    if (!stream) {
+        bcast_chunked((unsigned char*)cache->dataset, (size_t)cache->padd_rows * cache->image_size, MPI_COMM_WORLD);
+        return 0;
+    }
+
+    piece_rows = DATASET_BCAST_CHUNK / cache->image_size / 64 * 64;
+    if (piece_rows < 64) piece_rows = 64;
+    total_rows = cache->padd_rows;
+    num_pieces = (total_rows + piece_rows - 1) / piece_rows;
+    piece_requests = (MPI_Request*)malloc(sizeof(MPI_Request) * num_pieces);
+    for (int i = 0; i < num_pieces; ++i) {
+        const int begin = i * piece_rows;
+        const int rows = (total_rows - begin < piece_rows) ? total_rows - begin : piece_rows;
+        MPI_Ibcast((unsigned char*)cache->dataset + (size_t)begin * cache->image_size, rows * cache->image_size,
+            MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD, &piece_requests[i]);
+    }
+    return 0;
+}
+
+/*
+ * node and hier: the reader (each node leader, or rank 0 alone) opens the
+ * dataset and copies it into its node's window, which hier then broadcasts
+ * across the node leaders
+ */
+static int open_node(dataset_cache_t *cache, const char *cache_path, const char *raw_path, int tile, int hierarchical)
+{
+    int rank, node_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm leader_comm = MPI_COMM_NULL;
+    if (hierarchical)
+        MPI_Comm_split(MPI_COMM_WORLD, (node_rank == 0) ? 0 : MPI_UNDEFINED, rank, &leader_comm);
+
+    const int reader = hierarchical ? (rank == 0) : (node_rank == 0);
+    int info[2] = {LOAD_FAILED, 0}; // {status, num_images}
+    if (reader && dataset_cache_open(cache, cache_path, raw_path, tile) == 0) {
+        // hier shares even a cache file, so that no other node touches the file system
+        info[0] = (cache->map && !hierarchical) ? LOAD_MAPPED : LOAD_SHARED;
+        info[1] = cache->num_images;
+    }
+    MPI_Bcast(info, 2, MPI_INT, 0, hierarchical ? MPI_COMM_WORLD : node_comm);
+
+    if (info[0] != LOAD_SHARED) {
+        int ok = (info[0] == LOAD_MAPPED);
+        if (ok && !reader)
+            ok = (dataset_cache_open(cache, cache_path, raw_path, tile) == 0);
+        if (leader_comm != MPI_COMM_NULL) MPI_Comm_free(&leader_comm);
+        MPI_Comm_free(&node_comm);
+        return ok ? 0 : -1;
+    }
+    if (!reader)
+        init_geometry(cache, info[1], tile);
+
+    // the whole padded dataset lives in the node leader's segment
+    const size_t padd_size = (size_t)cache->padd_rows * cache->image_size;
+    unsigned char *base;
+    MPI_Win_allocate_shared(
+        (node_rank == 0) ? (MPI_Aint)padd_size : 0, 1, MPI_INFO_NULL, node_comm, &base, &win);
+    if (node_rank != 0) {
+        MPI_Aint size;
+        int disp_unit;
+        MPI_Win_shared_query(win, 0, &size, &disp_unit, &base);
+    }
+    if (reader) {
+        memcpy(base, cache->dataset, padd_size);
+        free(cache->buf);
+        cache->buf = NULL;
+    }
+    if (leader_comm != MPI_COMM_NULL) {
+        bcast_chunked(base, padd_size, leader_comm);
+        MPI_Comm_free(&leader_comm);
+    }
+    MPI_Win_fence(0, win);
+
+    cache->dataset = base;
+    return 0;
+}
+
+int dataset_load_open(dataset_cache_t *cache, const char *cache_path, const char *raw_path, int tile, int load)
+{
+    memset(cache, 0, sizeof(*cache));
+    wait_seconds = 0;
+    int err = -1;
+    switch (load) {
+    case DATASET_LOAD_READ:
+        err = open_read(cache, cache_path, raw_path, tile);
+        break;
+    case DATASET_LOAD_BCAST:
+    case DATASET_LOAD_STREAM:
+        err = open_bcast(cache, cache_path, raw_path, tile, load == DATASET_LOAD_STREAM);
+        break;
+    case DATASET_LOAD_NODE:
+    case DATASET_LOAD_HIER:
+        err = open_node(cache, cache_path, raw_path, tile, load == DATASET_LOAD_HIER);
+        break;
+    }
+
+    // read and node can fail on some ranks only (e.g. a cache file missing
+    // on one node), and every rank has to agree before any of them goes on
+    int ok = (err == 0), all;
+    MPI_Allreduce(&ok, &all, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if (!all) {
+        if (ok) dataset_load_close(cache);
+        memset(cache, 0, sizeof(*cache));
+        return -1;
+    }
+    if (!piece_requests) {
+        piece_rows = total_rows = cache->padd_rows;
+        num_pieces = 1;
+    }
+    return 0;
+}
+
+double dataset_load_wait_seconds(void)
+{
+    return wait_seconds;
+}
+
+int dataset_load_num_pieces(void)
+{
+    return num_pieces;
+}
+
+void dataset_load_piece(int i, int *begin, int *end)
+{
+    if (piece_requests) {
+        const double start = MPI_Wtime();
+        MPI_Wait(&piece_requests[i], MPI_STATUS_IGNORE);
+        wait_seconds += MPI_Wtime() - start;
+    }
+    *begin = i * piece_rows;
+    *end = (total_rows - *begin < piece_rows) ? total_rows : *begin + piece_rows;
+}
+
+void dataset_load_close(dataset_cache_t *cache)
+{
+    if (piece_requests) {
+        // pieces nobody asked for are still in flight
+        MPI_Waitall(num_pieces, piece_requests, MPI_STATUSES_IGNORE);
+        free(piece_requests);
+        piece_requests = NULL;
+    }
+
+    // the cache file, or a private copy; the window is not the cache's
+    dataset_cache_close(cache);
+    if (win != MPI_WIN_NULL) {
+        MPI_Win_free(&win);
+        MPI_Comm_free(&node_comm);
+    }
+}
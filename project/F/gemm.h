@@ -0,0 +1,23 @@
+#pragma once
+
+/*
+ * squared L2 norm of each row of a (rows x cols, row-major)
+ * or each column of b (rows x cols, row-major)
+ */
+void sqnorm_rows(const unsigned char *a, int rows, int cols, int *norm);
+void sqnorm_cols(const unsigned char *b, int rows, int cols, int *norm);
+
+/*
+ * for each column j < m of b[Q][R], find the row i < n of a[P][Q] minimizing
+ * norm_a[i] + norm_b[j] - 2 * a[i].b[j] (= |a[i] - b[j]|^2)
+ * and write it to min_diff[j], idx[j] (ties resolve to the lowest i)
+ *
+ * the P x R product is never materialized; each thread keeps a running
+ * (min, argmin) for its block of columns while streaming through a
+ *
+ * P, Q and R should be multiples of GEMM_TSIZE
+ */
+#define GEMM_TSIZE 16
+void gemm_u8_argmin(const unsigned char *a, const unsigned char *b,
+    const int *norm_a, const int *norm_b, int n, int m,
+    int P, int Q, int R, int *min_diff, int *idx);
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "photomosaic.h"
+#include "dataset_load.h"
+#include "timer.h"
+#include "qdbmp.h"
+
+int main(int argc, char **argv) {
+    // OpenMP threads never call MPI
+    int provided;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+    
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    
+    /*
+     * options : -t tile size, -d tile library (its cache file is looked up next to it),
+     *           -l how the ranks load it, see dataset_load.h
+     */
+    int T = DATASET_DEFAULT_TILE;
+    const char *dataset_path = DATASET_DEFAULT_PATH;
+    int load = DATASET_LOAD_DEFAULT;
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-t") == 0) T = atoi(argv[2]);
+        else if (strcmp(argv[1], "-d") == 0) dataset_path = argv[2];
+        else if (strcmp(argv[1], "-l") == 0) load = dataset_load_parse(argv[2]);
+        else break;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3 || load < 0) {
+        if (rank == 0)   
+            printf("Usage : %s [-t tile] [-d dataset.bin] [-l read|bcast|node|hier|stream] [input.bmp] [output.bmp]\n", argv[0]);
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * read the tile library first: with -l stream its broadcasts are in
+     * flight while rank 0 reads the input image below
+     */
+    dataset_cache_t cache;
+    char cache_path[4096];
+    dataset_cache_path(cache_path, sizeof(cache_path), dataset_path);
+    timer_start(2);
+    int load_failed = dataset_load_open(&cache, cache_path, dataset_path, T, load) != 0;
+    double load_time = timer_stop(2), max_load_time;
+    MPI_Reduce(&load_time, &max_load_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (load_failed) {
+        if (rank == 0)
+            printf("%s not found\n", dataset_path);
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+    const unsigned char *dataset = cache.dataset;
+
+    if (rank == 0)
+        printf("dataset read success; %d images of %d x %d%s\n", cache.num_images, T, T, cache.map ? " (mapped cache)" : "");
+    if (rank == 0 && load == DATASET_LOAD_STREAM)
+        printf("dataset load (stream) : %f seconds to post the broadcasts on the slowest rank\n", max_load_time);
+    else if (rank == 0)
+        printf("dataset load (%s) : %f seconds on the slowest rank\n", dataset_load_name(load), max_load_time);
+
+    /*
+     * read input image
+     */
+    BMP *bmp = NULL;
+    int width = 0, height = 0, depth = 0;
+    if (rank == 0) {
+        bmp = BMP_ReadFile(argv[1]);
+        if (BMP_GetError() != BMP_OK) {
+            fprintf(stderr, "BMP error: %s\n", BMP_GetErrorDescription());
+        }
+        else {
+            width = BMP_GetWidth(bmp);
+            height = BMP_GetHeight(bmp);
+            depth = BMP_GetDepth(bmp);
+            printf("image read success; image = %s, width = %d, height = %d, depth = %d\n", argv[1], width, height, depth);
+            if (width % T != 0 || height % T != 0) {
+                printf("width and height should be multiple of %d.\n", T);
+            }
+            if (depth != 24) {
+                printf("depth should be 24.\n");
+            }
+        }
+    }
+
+    int info[3] = {width, height, depth};
+    MPI_Bcast(info, 3, MPI_INT, 0, MPI_COMM_WORLD);
+    width = info[0], height = info[1], depth = info[2];
+    if (T <= 0 || width % T != 0 || height % T != 0 || depth != 24) {
+        dataset_load_close(&cache);
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char *img = (unsigned char*)malloc(height * width * 3), *it = img;
+    if (rank == 0) {
+        for (int i = 0; i < height; ++i) {
+            for (int j = 0; j < width; ++j) {
+                BMP_GetPixelRGB(bmp, j, i, it, it + 1, it + 2);
+                it += 3;
+            }
+        }
+
+        BMP_Free(bmp);
+    }
+
+    /*
+     * photomosaic computation
+     */
+
+    int swidth = width / T, sheight = height / T;
+    int *idx = (int*)malloc(sheight * swidth * sizeof(int));
+    if (rank == 0)
+        timer_start(0);
+    photomosaic(img, width, height, &cache, idx);
+    if (rank == 0) 
+        printf("Elapsed time: %f sec\n", timer_stop(0));
+
+    // a streamed dataset is only complete once photomosaic() has waited for
+    // its last piece, comparable with the other strategies' load time
+    if (load == DATASET_LOAD_STREAM) {
+        load_time += dataset_load_wait_seconds();
+        MPI_Reduce(&load_time, &max_load_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        if (rank == 0)
+            printf("dataset load (stream) : %f seconds posting and waiting for pieces on the slowest rank\n", max_load_time);
+    }
+
+    /*
+     * construct output image
+     */
+    if (rank == 0) {
+        bmp = BMP_Create(width, height, depth);
+        for (int sh = 0; sh < sheight; ++sh) {
+            for (int sw = 0; sw < swidth; ++sw) {
+                for (int h = 0; h < T; ++h) {
+                    for (int w = 0; w < T; ++w) {
+                        unsigned char rgb[3];
+                        for (int c = 0; c < 3; ++c) {
+                            rgb[c] = dataset[(((size_t)idx[sh * swidth + sw] * 3 + c) * T + h) * T + w];
+                        }
+                        BMP_SetPixelRGB(bmp, sw * T + w, sh * T + h, rgb[0], rgb[1], rgb[2]);
+                    }
+                }
+            }
+        }
+        BMP_WriteFile(bmp, argv[2]);
+        BMP_Free(bmp);
+        printf("image write success\n");
+    }
+
+    /*
+     * free resources
+     */
+    if (rank == 0) {
+        free(img);
+        free(idx);
+    }
+    dataset_load_close(&cache);
+
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include "photomosaic.h"
+#include "gemm.h"
+#include "dataset_load.h"
+#include "tile_memo.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include <mpi.h>
+
+/*
+ * project/D's tile distribution over MPI with project/A's OpenMP matcher,
+ * for nodes without OpenCL devices: rank 0 packs the tiles and scatters an
+ * even share to every rank, each rank matches its share with
+ * gemm_u8_argmin on all its cores, and rank 0 gathers the indices
+ *
+ * gemm.c runs NUM_THREADS threads, so run one rank per node
+ */
+#define NUM_THREADS 32
+
+typedef unsigned char uchar;
+
+void photomosaic(unsigned char *img, int width, int height, const dataset_cache_t *cache, int *idx)
+{
+    int size, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    const int T = cache->tile;
+    const int swidth = width / T, sheight = height / T;
+    const int num_tiles_image = sheight * swidth;
+    const int Q = cache->image_size;
+
+    if (rank == 0)
+        timer_start(1);
+    uchar *img_t = (uchar*)malloc(sizeof(uchar) * num_tiles_image * Q);
+    if (rank == 0) {
+        #pragma omp parallel num_threads(NUM_THREADS)
+        {
+            #pragma omp for schedule(guided) collapse(2)
+            for (int sh = 0; sh < sheight; ++sh) {
+                for (int sw = 0; sw < swidth; ++sw) {
+                    for (int c = 0; c < 3; ++c) {
+                        for (int h = 0; h < T; ++h) {
+                            for (int w = 0; w < T; ++w) {
+                                // img_t[sh][sw][c][h][w] = img[sh * T + h][sw * T + w][c]
+                                img_t[(size_t)(sh * swidth + sw) * Q + (c * T + h) * T + w] = img[(sh * T + h) * width * 3 + (sw * T + w) * 3 + c];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // rank 0 keeps one copy of each repeated tile, only those are scattered and matched
+    tile_memo_t memo;
+    int num_tiles_all = num_tiles_image;
+    if (rank == 0) {
+        tile_memo_init(&memo, cache, 0);
+        num_tiles_all = tile_memo_begin(&memo, img_t, num_tiles_image);
+    }
+    MPI_Bcast(&num_tiles_all, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    int *num_tiles_per_node = (int*)malloc(sizeof(int) * size);
+    int *num_tiles_offset = (int*)malloc(sizeof(int) * size);
+    int *img_t_size = (int*)malloc(sizeof(int) * size);
+    int *img_t_offset = (int*)malloc(sizeof(int) * size);
+    for (int i = 0; i < size; ++i) {
+        num_tiles_per_node[i] = num_tiles_all / size;
+        if (i < num_tiles_all % size) ++num_tiles_per_node[i];
+        num_tiles_offset[i] = (i > 0) ? (num_tiles_offset[i - 1] + num_tiles_per_node[i - 1]) : 0;
+
+        img_t_size[i] = num_tiles_per_node[i] * Q;
+        img_t_offset[i] = (i > 0) ? (img_t_offset[i - 1] + img_t_size[i - 1]) : 0;
+    }
+    const int num_tiles = num_tiles_per_node[rank];
+
+    MPI_Request request_img_t;
+    // rank 0's share is img_t[0 .. num_tiles) already, and stays in place
+    MPI_Iscatterv(img_t, img_t_size, img_t_offset, MPI_UNSIGNED_CHAR,
+        (rank == 0) ? MPI_IN_PLACE : img_t, num_tiles * Q, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD, &request_img_t);
+
+    if (rank == 0) {
+        printf("\nNumber of tiles = %d x %d = %d (%d to match)\n", sheight, swidth, num_tiles_image, num_tiles_all);
+        printf("Number of processors = %d\n", size);
+        for (int i = 0; i < size; ++i) {
+            printf(" - rank %d : %d tiles ( tiles[%d ... %d) )\n", i, num_tiles_per_node[i], num_tiles_offset[i], num_tiles_offset[i] + num_tiles_per_node[i]);
+        }
+        printf("\n");
+    }
+
+    // the whole dataset is needed here, including any pieces still being streamed
+    for (int p = 0; p < dataset_load_num_pieces(); ++p) {
+        int row_begin, row_end;
+        dataset_load_piece(p, &row_begin, &row_end);
+    }
+
+    /*
+     * |a - b|^2 = |a|^2 + |b|^2 - 2 * a.b, as in project/A
+     * dataset norms come from the cache file when this rank has them
+     */
+    const int *norm_dataset = cache->norm;
+    int *norm_buf = NULL;
+    if (!norm_dataset) {
+        norm_buf = (int*)malloc(sizeof(int) * cache->padd_rows);
+        sqnorm_rows(cache->dataset, cache->padd_rows, Q, norm_buf);
+        norm_dataset = norm_buf;
+    }
+    MPI_Wait(&request_img_t, MPI_STATUS_IGNORE);
+
+    // gemm_u8_argmin takes the tiles as columns, b[q][t] = img_t[t][q]
+    const int R = (num_tiles + GEMM_TSIZE - 1) / GEMM_TSIZE * GEMM_TSIZE;
+    uchar *b = (uchar*)malloc(sizeof(uchar) * Q * (size_t)R);
+    int *norm_b = (int*)malloc(sizeof(int) * R);
+    int *min_diff = (int*)malloc(sizeof(int) * R);
+    #pragma omp parallel for num_threads(NUM_THREADS) schedule(static)
+    for (int q = 0; q < Q; ++q) {
+        for (int t = 0; t < R; ++t) {
+            b[(size_t)q * R + t] = (t < num_tiles) ? img_t[(size_t)t * Q + q] : 0;
+        }
+    }
+    if (rank == 0)
+        printf("prepare img_t: %f seconds\n", timer_stop(1));
+
+    timer_start(3);
+    if (num_tiles > 0) {
+        sqnorm_cols(b, Q, R, norm_b);
+        gemm_u8_argmin(cache->dataset, b, norm_dataset, norm_b, cache->num_images, num_tiles,
+            cache->padd_rows, Q, R, min_diff, idx);
+    }
+    printf("[rank %d] mat_mul & set idx: %f seconds\n", rank, timer_stop(3));
+
+    MPI_Gatherv((rank == 0) ? MPI_IN_PLACE : idx, num_tiles, MPI_INT, idx, num_tiles_per_node, num_tiles_offset, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        tile_memo_end(&memo, idx);
+        tile_memo_release(&memo);
+        printf("\n");
+    }
+
+    free(img_t);
+    free(b);
+    free(norm_b);
+    free(min_diff);
+    free(norm_buf);
+    free(num_tiles_per_node);
+    free(num_tiles_offset);
+    free(img_t_size);
+    free(img_t_offset);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "dataset_cache.h"
+
+void photomosaic(unsigned char *img, int width, int height, const dataset_cache_t *cache, int *idx);
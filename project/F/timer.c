@@ -0,0 +1,19 @@
+#include <sys/time.h>
+
+#define N 16
+
+static double start_time[N];
+
+static double get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void timer_start(int i) {
+    start_time[i] = get_time();
+}
+
+double timer_stop(int i) {
+    return get_time() - start_time[i];
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+void timer_start(int i);
+double timer_stop(int i);
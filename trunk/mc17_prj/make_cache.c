@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dataset_cache.h"
+#include "pyramid.h"
+#include "timer.h"
+
+typedef unsigned char uchar;
+
+static long long align_page(long long offset)
+{
+    return (offset + 4095) / 4096 * 4096;
+}
+
+static void write_section(FILE *out, const dataset_cache_header_t *header, int s, const void *data)
+{
+    fseek(out, header->offset[s], SEEK_SET);
+    if (fwrite(data, 1, header->size[s], out) != (size_t)header->size[s]) {
+        printf("failed to write section %d\n", s);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        printf("Usage : %s [cifar-10.bin] [cifar-10.cache] [tile = %d]\n", argv[0], DATASET_DEFAULT_TILE);
+        exit(EXIT_FAILURE);
+    }
+    const int T = argc == 4 ? atoi(argv[3]) : DATASET_DEFAULT_TILE;
+
+    dataset_cache_t raw;
+    if (dataset_cache_open(&raw, NULL, argv[1], T) != 0) {
+        printf("%s not found\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    const uchar *dataset = raw.dataset;
+    const int N = raw.num_images, Q = raw.image_size;
+    const int P = raw.padd_rows, R = raw.padd_cols;
+    printf("%d images of %d x %d\n", N, T, T);
+
+    timer_start(0);
+
+    /* dataset_t[Q][R] for the conv kernel of project/B-E */
+    uchar *dataset_t = (uchar*)calloc((size_t)Q * R, 1);
+    #pragma omp parallel for schedule(static)
+    for (int q = 0; q < Q; ++q) {
+        for (int i = 0; i < N; ++i) {
+            dataset_t[(size_t)q * R + i] = dataset[(size_t)i * Q + q];
+        }
+    }
+
+    /* squared norms for the gemm engine of project/A */
+    int *norm = (int*)malloc(sizeof(int) * P);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < P; ++i) {
+        int sum = 0;
+        for (int q = 0; q < Q; ++q) {
+            int x = dataset[(size_t)i * Q + q];
+            sum += x * x;
+        }
+        norm[i] = sum;
+    }
+
+    /* pyramid levels for the reference matcher */
+    pyramid_t pyr;
+    pyramid_init(&pyr, N, T);
+    pyramid_build(&pyr, dataset);
+
+    printf("preprocess : %f seconds\n", timer_stop(0));
+
+    dataset_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DATASET_CACHE_VERSION;
+    header.num_images = N;
+    header.image_size = Q;
+    header.padd_rows = P;
+    header.padd_cols = R;
+    header.size[DC_DATASET] = (long long)P * Q;
+    header.size[DC_DATASET_T] = (long long)Q * R;
+    header.size[DC_NORM] = sizeof(int) * (long long)P;
+    header.size[DC_PYR_L0] = sizeof(int) * (long long)N * PYR_L0_SIZE;
+    header.size[DC_PYR_L1] = sizeof(unsigned short) * (long long)N * PYR_L1_SIZE;
+    header.size[DC_PYR_L2] = sizeof(unsigned short) * (long long)N * PYR_L2_SIZE;
+    long long offset = align_page(sizeof(header));
+    for (int s = 0; s < DC_NUM_SECTIONS; ++s) {
+        header.offset[s] = offset;
+        offset = align_page(offset + header.size[s]);
+    }
+
+    FILE *out = fopen(argv[2], "wb");
+    if (!out) {
+        printf("failed to open %s\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    write_section(out, &header, DC_DATASET, dataset);
+    write_section(out, &header, DC_DATASET_T, dataset_t);
+    write_section(out, &header, DC_NORM, norm);
+    write_section(out, &header, DC_PYR_L0, pyr.l0);
+    write_section(out, &header, DC_PYR_L1, pyr.l1);
+    write_section(out, &header, DC_PYR_L2, pyr.l2);
+    fclose(out);
+    printf("cache write success; %s (%lld bytes)\n", argv[2],
+        header.offset[DC_NUM_SECTIONS - 1] + header.size[DC_NUM_SECTIONS - 1]);
+
+    free(dataset_t);
+    free(norm);
+    pyramid_free(&pyr);
+    dataset_cache_close(&raw);
+
+    return 0;
+}
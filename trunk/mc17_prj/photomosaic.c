@@ -1,4 +1,7 @@
 #include "photomosaic.h"
+#include "ssd.h"
+#include "pyramid.h"
+#include "timer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,38 +9,182 @@
 #include <omp.h>
 
 #define NUM_THREADS 32
+#define MAX_FILTER_SIZE (3 * DATASET_MAX_TILE * DATASET_MAX_TILE)
 
-void photomosaic(unsigned char *img, int width, int height, unsigned char *dataset, int *idx) {
-    int swidth = width / 32, sheight = height / 32;
+/*
+ * SEARCH_BRUTE : full SSD against every candidate
+ * SEARCH_EARLY_ABANDON : accumulate the SSD in ABANDON_BLOCKS blocks (256
+ *                        bytes, 8 rows of one channel, for 32 x 32 tiles) and
+ *                        drop a candidate as soon as the partial sum exceeds
+ *                        the best so far
+ * SEARCH_PYRAMID : before early abandon, prune candidates whose pyramid
+ *                  lower bound (1 x 1, 4 x 4, then 8 x 8) exceeds the best
+ * every mode returns the same idx and diff as SEARCH_BRUTE
+ */
+#define SEARCH_BRUTE 0
+#define SEARCH_EARLY_ABANDON 1
+#define SEARCH_PYRAMID 2
+#ifndef SEARCH_MODE
+#define SEARCH_MODE SEARCH_PYRAMID
+#endif
+#define ABANDON_BLOCKS 12
+
+/* dataset geometry, set once per photomosaic() call */
+static int num_images, filter_size, abandon_block;
+
+static int search_brute(const unsigned char *tile, const unsigned char *dataset, int *min_diff_out)
+{
+    int min_diff = INT_MAX, min_i = -1;
+    for (int i = 0; i < num_images; ++i) {
+        int diff = ssd_u8(tile, dataset + (size_t)i * filter_size, filter_size);
+        if (min_diff > diff) {
+            min_diff = diff;
+            min_i = i;
+        }
+    }
+    *min_diff_out = min_diff;
+    return min_i;
+}
+
+/*
+ * SSD that stops once the partial sum exceeds bound
+ * (the result is then only known to be larger than bound)
+ */
+static int ssd_early_abandon(const unsigned char *tile, const unsigned char *candidate, int bound, long long *blocks)
+{
+    int diff = 0;
+    for (int k = 0; k < filter_size && diff <= bound; k += abandon_block) {
+        diff += ssd_u8(tile + k, candidate + k, abandon_block);
+        ++*blocks;
+    }
+    return diff;
+}
+
+/*
+ * seed is evaluated first so that the bound is tight from the start;
+ * ties still go to the lowest index, as in search_brute
+ */
+static int search_early_abandon(const unsigned char *tile, const unsigned char *dataset, int seed, int *min_diff_out, long long *blocks)
+{
+    int min_diff = ssd_u8(tile, dataset + (size_t)seed * filter_size, filter_size), min_i = seed;
+    *blocks += ABANDON_BLOCKS;
+    for (int i = 0; i < num_images; ++i) {
+        if (i == seed) continue;
+        int diff = ssd_early_abandon(tile, dataset + (size_t)i * filter_size, min_diff, blocks);
+        if (diff < min_diff || (diff == min_diff && i < min_i)) {
+            min_diff = diff;
+            min_i = i;
+        }
+    }
+    *min_diff_out = min_diff;
+    return min_i;
+}
+
+/*
+ * stats[l] counts candidates that survive level l of the pyramid,
+ * stats[3] counts evaluated ssd blocks
+ */
+static int search_pyramid(const unsigned char *tile, const pyramid_t *tile_pyr, const unsigned char *dataset, const pyramid_t *pyr, int seed, int *min_diff_out, long long *stats)
+{
+    int min_diff = ssd_u8(tile, dataset + (size_t)seed * filter_size, filter_size), min_i = seed;
+    stats[3] += ABANDON_BLOCKS;
+    for (int i = 0; i < num_images; ++i) {
+        if (i == seed) continue;
+        int level = 0;
+        while (level < 3 && pyramid_bound(pyr, i, tile_pyr, 0, level) <= min_diff) {
+            ++stats[level++];
+        }
+        if (level < 3) continue;
+
+        int diff = ssd_early_abandon(tile, dataset + (size_t)i * filter_size, min_diff, &stats[3]);
+        if (diff < min_diff || (diff == min_diff && i < min_i)) {
+            min_diff = diff;
+            min_i = i;
+        }
+    }
+    *min_diff_out = min_diff;
+    return min_i;
+}
+
+void photomosaic(unsigned char *img, int width, int height, const dataset_cache_t *cache, int *idx) {
+    const int T = cache->tile;
+    int swidth = width / T, sheight = height / T;
+    const unsigned char *dataset = cache->dataset;
+    num_images = cache->num_images;
+    filter_size = cache->image_size;
+    abandon_block = filter_size / ABANDON_BLOCKS;
 
     FILE *out = fopen("stats.txt", "w");
     int *diff = (int*)malloc(sizeof(int) * swidth * sheight);
+    long long stats[4] = {0, 0, 0, 0};
+    printf("ssd kernel : %s\n", ssd_init());
+
+    pyramid_t pyr;
+    if (SEARCH_MODE == SEARCH_PYRAMID && cache->pyr_l0) {
+        // levels from the mapped cache file, never freed here
+        pyramid_attach(&pyr, num_images, T, cache->pyr_l0, cache->pyr_l1, cache->pyr_l2);
+    }
+    else if (SEARCH_MODE == SEARCH_PYRAMID) {
+        timer_start(1);
+        pyramid_init(&pyr, num_images, T);
+        pyramid_build(&pyr, dataset);
+        printf("build pyramid : %f seconds\n", timer_stop(1));
+    }
 
-    #pragma omp parallel num_threads(NUM_THREADS)
+    #pragma omp parallel num_threads(NUM_THREADS) reduction(+:stats[:4])
     {
+        // neighboring tiles tend to match similar images, so the previous
+        // result of this thread is a good first candidate
+        int seed = 0;
+        pyramid_t tile_pyr;
+        if (SEARCH_MODE == SEARCH_PYRAMID)
+            pyramid_init(&tile_pyr, 1, T);
+
         #pragma omp for schedule(guided) collapse(2)
         for (int sh = 0; sh < sheight; ++sh) {
             for (int sw = 0; sw < swidth; ++sw) {
-                int min_diff = INT_MAX, min_i = -1;
-                for (int i = 0; i < 60000; ++i) {
-                    int diff = 0;
-                    for (int h = 0; h < 32; ++h) {
-                        for (int w = 0; w < 32; ++w) {
-                            for (int c = 0; c < 3; ++c) {
-                                int pixel_diff = (int)img[((sh * 32 + h) * width + (sw * 32 + w)) * 3 + c] - (int)dataset[((i * 3 + c) * 32 + h) * 32 + w];
-                                diff += pixel_diff * pixel_diff;
-                            }
+                // pack the tile into the dataset layout, tile[c][h][w]
+                unsigned char tile[MAX_FILTER_SIZE];
+                for (int c = 0; c < 3; ++c) {
+                    for (int h = 0; h < T; ++h) {
+                        for (int w = 0; w < T; ++w) {
+                            tile[(c * T + h) * T + w] = img[((sh * T + h) * width + (sw * T + w)) * 3 + c];
                         }
                     }
-                    if (min_diff > diff) {
-                        min_diff = diff;
-                        min_i = i;
-                    }
+                }
+
+                int min_diff, min_i;
+                if (SEARCH_MODE == SEARCH_PYRAMID) {
+                    pyramid_build(&tile_pyr, tile);
+                    min_i = search_pyramid(tile, &tile_pyr, dataset, &pyr, seed, &min_diff, stats);
+                    seed = min_i;
+                }
+                else if (SEARCH_MODE == SEARCH_EARLY_ABANDON) {
+                    min_i = search_early_abandon(tile, dataset, seed, &min_diff, &stats[3]);
+                    seed = min_i;
+                }
+                else {
+                    min_i = search_brute(tile, dataset, &min_diff);
                 }
                 idx[sh * swidth + sw] = min_i;
                 diff[sh * swidth + sw] = min_diff;
             }
         }
+
+        if (SEARCH_MODE == SEARCH_PYRAMID)
+            pyramid_free(&tile_pyr);
+    }
+
+    long long candidates = (long long)swidth * sheight * num_images;
+    if (SEARCH_MODE == SEARCH_PYRAMID) {
+        printf("pyramid : l0 pass %.1f%%, l1 pass %.1f%%, l2 pass %.1f%%\n",
+            100.0 * stats[0] / candidates, 100.0 * stats[1] / candidates, 100.0 * stats[2] / candidates);
+        if (!cache->pyr_l0)
+            pyramid_free(&pyr);
+    }
+    if (SEARCH_MODE != SEARCH_BRUTE) {
+        long long total = candidates * ABANDON_BLOCKS;
+        printf("early abandon : %lld / %lld ssd blocks (%.1f%%)\n", stats[3], total, 100.0 * stats[3] / total);
     }
 
     for (int sh = 0; sh < sheight; ++sh) {
@@ -0,0 +1,142 @@
+#include "pyramid.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#define NUM_THREADS 32
+
+static int log2i(int x)
+{
+    int r = 0;
+    while (x > 1) {
+        x >>= 1;
+        ++r;
+    }
+    return r;
+}
+
+static void set_tile(pyramid_t *pyr, int n, int tile)
+{
+    pyr->n = n;
+    pyr->tile = tile;
+    pyr->shift[0] = 2 * log2i(tile);
+    pyr->shift[1] = 2 * log2i(tile / 4);
+    pyr->shift[2] = 2 * log2i(tile / 8);
+}
+
+void pyramid_init(pyramid_t *pyr, int n, int tile)
+{
+    set_tile(pyr, n, tile);
+    pyr->l0 = (int*)malloc(sizeof(int) * n * PYR_L0_SIZE);
+    pyr->l1 = (unsigned short*)malloc(sizeof(unsigned short) * n * PYR_L1_SIZE);
+    pyr->l2 = (unsigned short*)malloc(sizeof(unsigned short) * n * PYR_L2_SIZE);
+}
+
+void pyramid_free(pyramid_t *pyr)
+{
+    free(pyr->l0);
+    free(pyr->l1);
+    free(pyr->l2);
+}
+
+void pyramid_attach(pyramid_t *pyr, int n, int tile, const int *l0, const unsigned short *l1, const unsigned short *l2)
+{
+    set_tile(pyr, n, tile);
+    pyr->l0 = (int*)l0;
+    pyr->l1 = (unsigned short*)l1;
+    pyr->l2 = (unsigned short*)l2;
+}
+
+/*
+ * tile is a constant at every call site below, so each tile size gets its
+ * own copy with the block loops fully unrolled
+ */
+static inline __attribute__((always_inline))
+void build_image(const unsigned char *img, int tile, int *l0, unsigned short *l1, unsigned short *l2)
+{
+    const int bw = tile / 8;
+
+    // (tile / 8)^2 pixel sums fit in 14 bits for tiles up to 64
+    memset(l2, 0, sizeof(unsigned short) * PYR_L2_SIZE);
+    for (int c = 0; c < 3; ++c) {
+        for (int h = 0; h < tile; ++h) {
+            const unsigned char *row = img + (c * tile + h) * tile;
+            unsigned short *out = l2 + (c * 8 + h / bw) * 8;
+            for (int w = 0; w < 8; ++w) {
+                int sum = 0;
+                for (int k = 0; k < bw; ++k) {
+                    sum += row[w * bw + k];
+                }
+                out[w] += sum;
+            }
+        }
+    }
+
+    // (tile / 4)^2 pixel sums fit in 16 bits for tiles up to 64
+    memset(l1, 0, sizeof(unsigned short) * PYR_L1_SIZE);
+    for (int c = 0; c < 3; ++c) {
+        for (int h = 0; h < 8; ++h) {
+            for (int w = 0; w < 8; ++w) {
+                l1[(c * 4 + h / 2) * 4 + w / 2] += l2[(c * 8 + h) * 8 + w];
+            }
+        }
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        l0[c] = 0;
+        for (int k = 0; k < 16; ++k) {
+            l0[c] += l1[c * 16 + k];
+        }
+    }
+}
+
+void pyramid_build(pyramid_t *pyr, const unsigned char *images)
+{
+    const int tile = pyr->tile;
+    #pragma omp parallel for num_threads(NUM_THREADS) schedule(static) if (pyr->n > 1)
+    for (int i = 0; i < pyr->n; ++i) {
+        const unsigned char *img = images + (size_t)i * 3 * tile * tile;
+        int *l0 = pyr->l0 + (size_t)i * PYR_L0_SIZE;
+        unsigned short *l1 = pyr->l1 + (size_t)i * PYR_L1_SIZE;
+        unsigned short *l2 = pyr->l2 + (size_t)i * PYR_L2_SIZE;
+
+        switch (tile) {
+        case 8: build_image(img, 8, l0, l1, l2); break;
+        case 16: build_image(img, 16, l0, l1, l2); break;
+        case 32: build_image(img, 32, l0, l1, l2); break;
+        default: build_image(img, 64, l0, l1, l2); break;
+        }
+    }
+}
+
+int pyramid_bound(const pyramid_t *a, int i, const pyramid_t *b, int j, int level)
+{
+    // m = 2^shift pixels per block, so ceil((Sa - Sb)^2 / m) is a shift
+    const int shift = a->shift[level], round = (1 << shift) - 1;
+    int bound = 0;
+    if (level == 0) {
+        // (Sa - Sb)^2 needs up to 44 bits
+        const int *x = a->l0 + (size_t)i * PYR_L0_SIZE, *y = b->l0 + (size_t)j * PYR_L0_SIZE;
+        for (int k = 0; k < PYR_L0_SIZE; ++k) {
+            long long d = x[k] - y[k];
+            bound += (int)((d * d + round) >> shift);
+        }
+    }
+    else if (level == 1) {
+        // (Sa - Sb)^2 needs up to 32 bits
+        const unsigned short *x = a->l1 + (size_t)i * PYR_L1_SIZE, *y = b->l1 + (size_t)j * PYR_L1_SIZE;
+        for (int k = 0; k < PYR_L1_SIZE; ++k) {
+            unsigned d = (unsigned)abs((int)x[k] - (int)y[k]);
+            bound += (int)((d * d + round) >> shift);
+        }
+    }
+    else {
+        const unsigned short *x = a->l2 + (size_t)i * PYR_L2_SIZE, *y = b->l2 + (size_t)j * PYR_L2_SIZE;
+        for (int k = 0; k < PYR_L2_SIZE; ++k) {
+            int d = (int)x[k] - (int)y[k];
+            bound += (d * d + round) >> shift;
+        }
+    }
+    return bound;
+}
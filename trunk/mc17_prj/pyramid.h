@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * per-channel block sums of 3 x tile x tile images at three resolutions
+ *  - l0 : 1 x 1 blocks of tile x tile pixels (mean color)
+ *  - l1 : 4 x 4 blocks of tile / 4 x tile / 4 pixels
+ *  - l2 : 8 x 8 blocks of tile / 8 x tile / 8 pixels
+ * (8 x 8 and 4 x 4 pixels for 32 x 32 tiles)
+ *
+ * for a block of m pixels with sums Sa, Sb, Cauchy-Schwarz gives
+ * sum (a - b)^2 >= (Sa - Sb)^2 / m, so pyramid_bound() is an exact lower
+ * bound of the full SSD and a candidate can be pruned once it exceeds the
+ * best diff so far
+ */
+#define PYR_L0_SIZE 3
+#define PYR_L1_SIZE (3 * 4 * 4)
+#define PYR_L2_SIZE (3 * 8 * 8)
+
+typedef struct {
+    int n, tile;
+    int shift[3];       // log2 of the pixels per block at each level
+    int *l0;            // [n][3]
+    unsigned short *l1; // [n][3][4][4]
+    unsigned short *l2; // [n][3][8][8]
+} pyramid_t;
+
+/* tile is a power of two in [8, 64], see dataset_cache.h */
+void pyramid_init(pyramid_t *pyr, int n, int tile);
+void pyramid_free(pyramid_t *pyr);
+
+/* wrap levels that were built elsewhere (e.g. mapped from a cache file), not freed */
+void pyramid_attach(pyramid_t *pyr, int n, int tile, const int *l0, const unsigned short *l1, const unsigned short *l2);
+
+/* build the levels of n images laid out as [n][c][h][w] */
+void pyramid_build(pyramid_t *pyr, const unsigned char *images);
+
+/* lower bound of the SSD between a's i-th and b's j-th image at the given level */
+int pyramid_bound(const pyramid_t *a, int i, const pyramid_t *b, int j, int level);
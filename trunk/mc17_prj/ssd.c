@@ -0,0 +1,102 @@
+#include "ssd.h"
+
+#include <immintrin.h>
+
+typedef unsigned char uchar;
+
+ssd_fn ssd_u8 = ssd_u8_scalar;
+
+const char *ssd_init()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        ssd_u8 = ssd_u8_avx512;
+        return "avx512";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        ssd_u8 = ssd_u8_avx2;
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        ssd_u8 = ssd_u8_sse4;
+        return "sse4";
+    }
+    ssd_u8 = ssd_u8_scalar;
+    return "scalar";
+}
+
+int ssd_u8_scalar(const uchar *a, const uchar *b, int n)
+{
+    int sum = 0;
+    for (int i = 0; i < n; ++i) {
+        int d = (int)a[i] - (int)b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+/*
+ * every path widens 16 bytes to 16-bit lanes, subtracts, and lets pmaddwd
+ * square and pair-sum the differences into 32-bit lanes
+ */
+
+__attribute__((target("sse4.1")))
+int ssd_u8_sse4(const uchar *a, const uchar *b, int n)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i dlo = _mm_sub_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb));
+        __m128i dhi = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(va, 8)), _mm_cvtepu8_epi16(_mm_srli_si128(vb, 8)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(dlo, dlo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(dhi, dhi));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc) + ssd_u8_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int ssd_u8_avx2(const uchar *a, const uchar *b, int n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i dlo = _mm256_sub_epi16(
+            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va)),
+            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(vb)));
+        __m256i dhi = _mm256_sub_epi16(
+            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1)),
+            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(vb, 1)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(dlo, dlo));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(dhi, dhi));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s) + ssd_u8_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int ssd_u8_avx512(const uchar *a, const uchar *b, int n)
+{
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i va = _mm512_loadu_si512((const void*)(a + i));
+        __m512i vb = _mm512_loadu_si512((const void*)(b + i));
+        __m512i dlo = _mm512_sub_epi16(
+            _mm512_cvtepu8_epi16(_mm512_castsi512_si256(va)),
+            _mm512_cvtepu8_epi16(_mm512_castsi512_si256(vb)));
+        __m512i dhi = _mm512_sub_epi16(
+            _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(va, 1)),
+            _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(vb, 1)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(dlo, dlo));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(dhi, dhi));
+    }
+    return _mm512_reduce_add_epi32(acc) + ssd_u8_avx2(a + i, b + i, n - i);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * sum of squared differences of two packed uint8 vectors of length n
+ * ssd_u8 points to the widest implementation the running CPU supports
+ * (scalar, SSE4.1, AVX2 or AVX-512BW) once ssd_init() has been called
+ */
+typedef int (*ssd_fn)(const unsigned char *a, const unsigned char *b, int n);
+extern ssd_fn ssd_u8;
+
+/* select the implementation and return its name */
+const char *ssd_init();
+
+int ssd_u8_scalar(const unsigned char *a, const unsigned char *b, int n);
+int ssd_u8_sse4(const unsigned char *a, const unsigned char *b, int n);
+int ssd_u8_avx2(const unsigned char *a, const unsigned char *b, int n);
+int ssd_u8_avx512(const unsigned char *a, const unsigned char *b, int n);